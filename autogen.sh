@@ -3,7 +3,7 @@
 # simple autogen script that generates basic layout for autotools.
 # not meant to be included in distribution.
 
-COMMON_CPPFLAGS="-I\$(srcdir)/include/ -I/usr/local/include"
+COMMON_CPPFLAGS="-iquote \$(srcdir)/include/ -I/usr/local/include"
 COMMON_CFLAGS="-Wall"
 COMMON_LDFLAGS="-L/usr/local/lib"
 
@@ -22,8 +22,8 @@ echo "cloudvpndir = src/" >>$OUT
 echo "cloudvpn_SOURCES = `echo src/*.c`" >>$OUT
 echo "cloudvpn_CPPFLAGS = ${COMMON_CPPFLAGS}" >>$OUT
 echo "cloudvpn_CFLAGS = ${COMMON_CFLAGS}" >>$OUT
-echo "cloudvpn_LDFLAGS = ${COMMON_LDFLAGS}" >>$OUT
-echo "cloudvpn_LDADD = -lev -lpthread -ldl " >>$OUT
+echo "cloudvpn_LDFLAGS = ${COMMON_LDFLAGS} -export-dynamic" >>$OUT
+echo "cloudvpn_LDADD = -lev -lpthread -ldl -lrt " >>$OUT
 [ -f src/Makefile.am.extra ] &&
 	while read l ; do
 		[ "$l" ] && echo "cloudvpn_${l}" >>$OUT
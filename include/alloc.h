@@ -27,5 +27,25 @@
 #define cl_realloc realloc
 #define cl_memcpy memcpy
 
+/* int cl_aligned_alloc(void**, alignment, size), returns nonzero on error */
+#define cl_aligned_alloc posix_memalign
+
+/*
+ * Object caches (slabs) for fixed-size objects that get allocated and freed
+ * very often, like works, events or packets. Every thread caches some free
+ * objects, so usual allocation and freeing doesn't take any lock. Plugins are
+ * welcome to create slabs for their own objects.
+ */
+
+struct cl_slab;
+
+struct cl_slab* cl_slab_create (size_t /*object size*/);
+void cl_slab_destroy (struct cl_slab*);
+
+void* cl_slab_alloc (struct cl_slab*);
+void cl_slab_free (struct cl_slab*, void*);
+
+#define cl_slab_new(type) cl_slab_create (sizeof (type) )
+
 #endif
 
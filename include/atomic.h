@@ -0,0 +1,39 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_ATOMIC_H
+#define _CVPN_ATOMIC_H
+
+/*
+ * Simple wrapper around atomic operations on integers and pointers. These
+ * map to gcc builtins, which are all full memory barriers. If you want to
+ * replace them, do it here.
+ */
+
+#define cl_atomic_add(p,v) __sync_add_and_fetch ( (p), (v) )
+#define cl_atomic_sub(p,v) __sync_sub_and_fetch ( (p), (v) )
+#define cl_atomic_get(p) __sync_add_and_fetch ( (p), 0)
+#define cl_atomic_cas(p,o,n) __sync_bool_compare_and_swap ( (p), (o), (n) )
+#define cl_barrier() __sync_synchronize()
+
+/* plain (possibly stale) read, that just can't be optimized out */
+#define cl_atomic_read(p) (* (volatile __typeof__ (* (p) ) *) (p) )
+
+/* tell the cpu that we are busy-waiting */
+#if defined(__i386__) || defined(__x86_64__)
+#define cl_cpu_relax() __builtin_ia32_pause()
+#else
+#define cl_cpu_relax() cl_barrier()
+#endif
+
+#endif
+
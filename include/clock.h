@@ -0,0 +1,26 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_CLOCK_H
+#define _CVPN_CLOCK_H
+
+/*
+ * monotonic time source for measuring and scheduling stuff inside cloudvpn.
+ */
+
+#include <stdint.h>
+
+uint64_t cl_clock_usec(); /* microseconds from some arbitrary point */
+uint64_t cl_clock_nsec(); /* same in nanoseconds, for measuring short stuff */
+
+#endif
+
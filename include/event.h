@@ -22,7 +22,7 @@
 enum {
 	event_fd_readable,
 	event_fd_writeable,
-	event_time, /* used to wait for some time */
+	event_time, /* used to wait for some time, rounded up to milliseconds */
 	event_async, /* synchronization of asynchronous events */
 	event_signal /* system signal received */
 };
@@ -41,6 +41,30 @@ struct event_data {
 struct event {
 	uint8_t priority;
 	short is_static;
+
+	/*
+	 * persistent events stay registered after they fire, timers then
+	 * repeat with the same interval. There's never more than one work for
+	 * a persistent event: until the work is processed, the event is busy
+	 * and doesn't fire again (it fires when the work is done, if it got
+	 * ready meanwhile). Unregistered persistent events that aren't static
+	 * are freed by the core when their last work is done.
+	 */
+	short is_persistent;
+
+	/*
+	 * if set, it's called instead of freeing the unregistered persistent
+	 * event, for static ones too. No work of the event exists anymore.
+	 */
+	void (*release) (struct event*);
+
+	/*
+	 * event loop that watches this event. -1 (set by cloudvpn_new_event)
+	 * chooses it by the owner part, so all events of a part are handled
+	 * by one loop. Signals are always watched by loop 0.
+	 */
+	int affinity;
+
 	struct event_data data;
 };
 
@@ -52,7 +76,49 @@ int cloudvpn_register_event (struct event*);
 int cloudvpn_unregister_event (struct event*);
 int cloudvpn_event_send_async (struct event*);
 
-void cloudvpn_wait_for_event();
+/*
+ * disabled persistent event doesn't fire until it's enabled again, then it
+ * fires if it's still ready. Both are cheap, and can be called from any
+ * thread.
+ */
+void cloudvpn_event_disable (struct event*);
+void cloudvpn_event_enable (struct event*);
+
+/* scheduler calls this when the work of a persistent event is done */
+void cloudvpn_event_done (struct event*);
+
+/*
+ * There can be several event loops, each watching its own subset of the
+ * events, so that they can be polled by several threads at once. Their
+ * number must be set before anything gets registered.
+ */
+
+#define MAX_EVENT_LOOPS 64
+
+int cloudvpn_event_set_loops (int);
+int cloudvpn_event_loops();
+
+/*
+ * There are two ways to run the event loops. Either the scheduler does it
+ * in work_poll, with cloudvpn_wait_for_event (and with cloudvpn_poll_event
+ * that doesn't block, if the poll waits too long), or dedicated threads run
+ * cloudvpn_event_thread. Only one thread runs a loop at a time.
+ */
+
+void cloudvpn_wait_for_event (int loop);
+void cloudvpn_wait_for_event_until (int loop, uint64_t); /* cl_clock_usec */
+void cloudvpn_poll_event (int loop);
+void cloudvpn_event_thread (int loop, int* /*keep_running*/);
+void cloudvpn_event_wakeup (int loop); /* make the waiting thread return */
+void cloudvpn_event_wakeup_all();
+
+/* lag is the time between event loop runs, in microseconds */
+struct event_loop_stats {
+	uint64_t last_lag, max_lag, total_lag;
+	uint64_t runs;
+};
+
+int cloudvpn_event_loop_stats (int loop, struct event_loop_stats*);
 
 int cloudvpn_event_init();
 int cloudvpn_event_finish();
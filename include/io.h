@@ -0,0 +1,74 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_IO_H
+#define _CVPN_IO_H
+
+/*
+ * Completion-based socket i/o for transports. Instead of waiting for the
+ * socket to get readable and reading it, transport opens an io socket and
+ * starts receiving; the core then reads the data itself and delivers them
+ * to the owner part as work_io works, each with a packet that holds the
+ * received bytes in data. Packets passed to cloudvpn_io_send are freed by
+ * the core after they are sent.
+ *
+ * There are two backends. With io_uring, sockets are read by multishot
+ * receives into buffers that the kernel picks from a ring provided by us,
+ * and sends are submitted in batches. With libev, it's done by the workers
+ * on readiness events. io_uring backend falls back to libev if the kernel
+ * can't do it.
+ */
+
+struct io_socket;
+struct part;
+struct packet;
+
+enum {
+	io_backend_libev,
+	io_backend_uring
+};
+
+/*
+ * must be set before any socket gets opened, after the number of event
+ * loops is set. Returns the backend that's really used.
+ */
+int cloudvpn_io_set_backend (int);
+int cloudvpn_io_backend();
+
+/*
+ * fd must be a nonblocking socket, and belongs to io socket from now on: it
+ * gets closed when the socket is closed and nothing uses it anymore.
+ * Received data get the priority.
+ */
+struct io_socket* cloudvpn_io_open (int fd, struct part*owner, int priority);
+void cloudvpn_io_close (struct io_socket*);
+
+/*
+ * receiving goes on until the end of stream or an error, which are reported
+ * by a work_io with no packet. Returns nonzero on error.
+ */
+int cloudvpn_io_recv_start (struct io_socket*);
+
+/* data are len bytes of p->data; packet is freed in any case */
+int cloudvpn_io_send (struct io_socket*, struct packet*);
+
+/*
+ * socket of a work_io stays valid until the work is deleted, even if it
+ * gets closed meanwhile; scheduler calls this then.
+ */
+void cloudvpn_io_done (struct io_socket*);
+
+int cloudvpn_io_init();
+void cloudvpn_io_finish();
+
+#endif
+
@@ -18,6 +18,8 @@
  * native) implementations, please feed them to mutex.c or so.
  */
 
+#include <stdint.h>
+
 typedef void* cl_mutex;
 typedef void* cl_cond;
 typedef void* cl_sem;
@@ -31,6 +33,7 @@ int cl_mutex_unlock (cl_mutex);
 int cl_cond_init (cl_cond*);
 int cl_cond_destroy (cl_cond);
 int cl_cond_wait (cl_cond, cl_mutex);
+int cl_cond_timedwait (cl_cond, cl_mutex, uint64_t /*usec*/);
 int cl_cond_signal (cl_cond);
 int cl_cond_broadcast (cl_cond);
 
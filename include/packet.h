@@ -43,6 +43,9 @@ void cloudvpn_packet_free (struct packet*);
 
 int cloudvpn_alloc_data (struct packet*);
 
+int cloudvpn_packet_init();
+void cloudvpn_packet_finish();
+
 
 #endif
 
@@ -28,6 +28,7 @@ struct part {
 	void*data;
 	char*name;
 	cl_sem refcount;
+	struct mailbox*mbox; /* work queue and scheduling stuff, see sched.h */
 };
 
 /* human usage in the config files */
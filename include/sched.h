@@ -18,41 +18,256 @@
  * It can also handle multicore tasks, etc.
  */
 
+#include <stdint.h>
+
+struct part;
+struct mailbox;
+struct io_socket;
+
 int cloudvpn_scheduler_init();
 int cloudvpn_scheduler_destroy();
 
+/* runs until the int becomes zero, wakeup_all should follow the change */
 int cloudvpn_scheduler_run (int*);
+void cloudvpn_scheduler_wakeup_all();
+
+/*
+ * flow steering keeps packets of one flow on one worker. Others can steal
+ * them only if the worker has more than steal_threshold of them waiting,
+ * and stolen packets are no longer kept in order.
+ */
+void cloudvpn_scheduler_set_steering (int enable, int steal_threshold);
+
+/*
+ * mailbox mode serializes all works for a part, so that plugin's
+ * process_work never runs on two threads at once.
+ */
+void cloudvpn_scheduler_set_mailboxes (int enable);
+
+struct mailbox* cloudvpn_new_mailbox (struct part*);
+void cloudvpn_delete_mailbox (struct mailbox*);
+
+/*
+ * in mailbox mode, parts that have work waiting share the cpu by their
+ * weights (default is 1). Cpu time of parts is accounted in both modes.
+ */
+void cloudvpn_part_set_weight (struct part*, int weight);
+
+struct part_sched_stats {
+	uint64_t cpu_time; /* nanoseconds spent in process_work */
+	uint64_t works;
+};
+
+void cloudvpn_part_sched_stats (struct part*, struct part_sched_stats*);
+
+/*
+ * idle worker spins for spin_usec, then yields the cpu for yield_usec, and
+ * parks after that. Zeroes mean parking right away.
+ */
+void cloudvpn_scheduler_set_idle_policy (int spin_usec, int yield_usec);
+
+struct sched_worker_stats {
+	uint64_t spin_time, yield_time, park_time; /* microseconds */
+	uint64_t spin_found, yield_found; /* times work was found */
+	uint64_t parks;
+
+	uint64_t deadline_works, deadline_misses; /* started too late */
+
+	uint64_t direct_works, direct_fallbacks; /* handoffs done inline */
+
+	uint64_t steals_local, steals_remote; /* from the same/other numa node */
+
+	/* current and highest lengths of worker's queue and flow queue */
+	uint64_t queue_len, queue_max, flow_queue_len, flow_queue_max;
+};
+
+int cloudvpn_scheduler_workers(); /* number of worker slots */
+int cloudvpn_scheduler_worker_stats (int, struct sched_worker_stats*);
+
+/*
+ * parked workers are woken only if the running ones can't take all the
+ * work; this counts the wakeups that were done and that were saved.
+ */
+void cloudvpn_scheduler_wakeup_stats (uint64_t*sent, uint64_t*saved);
+
+/*
+ * queues can be bounded, separately for each priority. When the queue is
+ * over half full, scheduling returns schedule_congested, so ingress parts
+ * should stop reading for a while. When it's full, work gets dropped by the
+ * policy: drop_tail drops the new work, drop_head the oldest one of the same
+ * priority, drop_red drops randomly (more often as the queue fills) already
+ * from the half. Dropped works (and their packets) are freed by scheduler.
+ * Works with deadlines and static works are never dropped.
+ */
+
+enum {
+	schedule_ok = 0,
+	schedule_error,
+	schedule_congested, /* accepted, but slow down */
+	schedule_dropped /* work was freed */
+};
+
+enum {
+	drop_tail,
+	drop_head,
+	drop_red
+};
+
+/* priority -1 sets all of them, capacity 0 means unbounded (default) */
+void cloudvpn_scheduler_set_limit (int priority, int capacity, int policy);
+
+/* works dropped at priority, or -1 for all of them */
+uint64_t cloudvpn_scheduler_drops (int priority);
 
 struct work* cloudvpn_new_work();
+void cloudvpn_delete_work (struct work*);
 int cloudvpn_schedule_work (struct work*);
+int cloudvpn_schedule_work_batch (struct work**, int); /* returns the worst */
+
+/*
+ * schedules the work at cl_clock_usec() time t (or right away if that's
+ * already past). Timers are kept by the worker that sets them and checked
+ * between the works, so this doesn't touch the event loop at all. Queue
+ * limits are applied when the time comes.
+ */
+int cloudvpn_schedule_work_at (struct work*, uint64_t t);
+
+/*
+ * direct dispatch: packet handed off to the next part with
+ * cloudvpn_handoff_work is processed right away on the calling worker, if
+ * the handoffs nest at most depth times and the chain took less than
+ * budget_usec. Otherwise (or with depth 0) it's just scheduled.
+ */
+void cloudvpn_scheduler_set_direct_dispatch (int depth, int budget_usec);
+int cloudvpn_handoff_work (struct work*);
+
+/*
+ * Continuations. Part that has a long job (like recomputing all routes)
+ * should do it in steps: after each step, it checks cloudvpn_should_yield,
+ * and if it says so, schedules a continuation with its state and returns.
+ * process_work of the part then gets a work_continuation work with the
+ * state, and can go on. Continuations are never dropped.
+ */
+int cloudvpn_schedule_continuation (struct part*, void*state, int priority);
+
+/*
+ * nonzero if more urgent work is waiting, or if the current work runs for
+ * more than the slice and any other work is waiting
+ */
+int cloudvpn_should_yield();
+void cloudvpn_scheduler_set_yield_slice (int usec); /* 0 = no slice */
 
 void cloudvpn_schedule_event_poll();
 
+/*
+ * ring backend: works without deadlines go through one lock-free ring of
+ * (at least) size slots, ignoring priorities and queue limits. If the ring
+ * is full, they go to the usual queues. Must be set before scheduling
+ * anything, returns nonzero on error.
+ */
+int cloudvpn_scheduler_set_ring (int size);
+
+/* if the event poll waits in queue for more than usec, poll anyway (0=off) */
+void cloudvpn_scheduler_set_poll_latency (int usec);
+
+/*
+ * telemetry: if enabled, workers keep histograms of how long the works
+ * waited in queue and how long they took to process, separately for each
+ * priority and work type. Bucket i counts times of at most 2^i nanoseconds
+ * (and more than half of that), the last one counts all the longer ones.
+ * Histograms are kept by every worker for itself and summed up only when
+ * somebody asks for the snapshot.
+ */
+void cloudvpn_scheduler_set_telemetry (int enable);
+
+#define SCHED_HIST_BUCKETS 32
+
+struct sched_histogram {
+	uint64_t count[SCHED_HIST_BUCKETS];
+	uint64_t total; /* sum of the times, nanoseconds */
+};
+
+struct sched_telemetry {
+	struct sched_histogram wait, service;
+};
+
+enum {
+	telemetry_priority,
+	telemetry_type
+};
+
+/* snapshot for the priority or work type index, returns nonzero on error */
+int cloudvpn_scheduler_telemetry (int by, int index, struct sched_telemetry*);
+
+/* highest length of the queue for non-workers */
+uint64_t cloudvpn_scheduler_shared_queue_max();
+
 enum {
 	work_packet, /* part processes a data packet */
 	work_event, /* part is woken up by an event */
 	work_poll, /* wait for events */
 	work_part_cleanup, /* broadcast about a part being removed */
 	work_plugin_cleanup, /* same for plugin */
-	work_command /* configuration command/statement (in packet) */
+	work_command, /* configuration command/statement (in packet) */
+	work_continuation, /* part resumes its long job */
+	work_io, /* data received on io socket, see io.h */
+	work_mailbox /* part's mailbox is processed (internal) */
 };
 
+#define WORK_TYPES (work_mailbox+1)
+
 #include "packet.h"
 #include "pool.h"
 #include "event.h"
 
 #define LOWEST_PRIORITY 255
 
+/* maximum number of threads that can run cloudvpn_scheduler_run at once */
+#define MAX_WORKERS 64
+
+/*
+ * Works are queued by an embedded link, so one struct work can't be scheduled
+ * again before it's processed. This is important for static works.
+ */
+
 struct work {
 	int type;
 	uint8_t priority; /* lower number gets processed faster */
 	short is_static; /* struct work is owned and freed by someone else */
 
+	/*
+	 * if nonzero, work is processed earliest deadline first, before all
+	 * works without deadline. In cl_clock_usec() time.
+	 */
+	uint64_t deadline;
+
+	uint64_t enqueued; /* cl_clock_nsec() when queued, for telemetry */
+	uint64_t at; /* cl_clock_usec() when to run, see schedule_work_at */
+
+	struct work* next; /* used by the scheduler */
+
 	union {
 		struct packet* p; /* packet to process */
-		struct event_data e;
+		struct {
+			struct event_data e;
+			struct event* ev; /* persistent event that fired */
+		};
 		struct part* pt; /* part to cleanup */
 		struct plugin* pl; /* plugin to cleanup */
+		struct mailbox* mb; /* mailbox to process */
+		int loop; /* event loop to poll */
+
+		struct {
+			struct part* owner;
+			void* state; /* whatever part needs to resume */
+		} c; /* continuation */
+
+		struct {
+			struct part* owner;
+			struct io_socket* s;
+			struct packet* p; /* received data, or 0 */
+			int result; /* bytes, 0 at end of stream or -errno */
+		} io;
 	};
 };
 
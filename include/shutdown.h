@@ -17,7 +17,7 @@
  * Shutdown is here for graceful exits, and is good for that.
  */
 
-int cloudvpn_shutdown (int); /* if parameter, cloudvpn respawns itself */
+int cloudvpn_shutdown (int); /* respawning (nonzero parameter) fails */
 
 #endif
 
@@ -0,0 +1,46 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_THREAD_H
+#define _CVPN_THREAD_H
+
+/*
+ * wrapper around threading stuff, same as mutex.h.
+ */
+
+#include <stddef.h>
+
+typedef void* cl_thread;
+typedef void* cl_tls;
+
+/* stack size 0 means system default */
+int cl_thread_create (cl_thread*, void* (*) (void*), void*, size_t stack_size);
+int cl_thread_join (cl_thread);
+void cl_thread_yield();
+
+/*
+ * pins calling thread to the n-th cpu that the process is allowed to use,
+ * counting the cpus of numa node 0 first, then node 1, etc.
+ */
+int cl_thread_set_affinity (int n);
+
+/* number of online cpus */
+int cl_cpu_count();
+
+/* destructor gets called with thread's nonzero value when the thread exits */
+int cl_tls_init (cl_tls*, void (*destructor) (void*) );
+int cl_tls_destroy (cl_tls);
+void* cl_tls_get (cl_tls);
+int cl_tls_set (cl_tls, void*);
+
+#endif
+
@@ -0,0 +1,34 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CVPN_TOPOLOGY_H
+#define _CVPN_TOPOLOGY_H
+
+/*
+ * NUMA topology of the machine, as seen in /sys. Without NUMA (or sysfs),
+ * everything is on a single node 0.
+ */
+
+#define CL_MAX_NODES 64
+#define CL_MAX_CPUS 1024
+
+/* reads the topology, call before any other function here */
+void cl_topology_init();
+
+int cl_node_count();
+int cl_cpu_node (int cpu);
+
+/* node of the cpu that the calling thread runs on right now */
+int cl_current_node();
+
+#endif
+
@@ -11,14 +11,230 @@
  */
 
 #include "boot.h"
+#include "sched.h"
+#include "event.h"
+#include "thread.h"
+#include "shutdown.h"
+#include "io.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * worker pool and scheduler settings, from the command line:
+ *
+ * -t N  run N worker threads (default is one for each online cpu)
+ * -p    pin the workers to cpus
+ * -s N  worker stack size in kilobytes (default is system default)
+ * -f N  steer packets of a flow to one worker, others can steal them if
+ *       more than N are waiting (stolen packets may get out of order)
+ * -m    process works of each part serially, through its mailbox
+ * -i N  idle worker spins for N microseconds before parking
+ * -y N  and then yields the cpu for N microseconds
+ * -e    run the event loops in dedicated threads
+ * -E N  use N event loops, polled by the workers of the same number
+ * -l N  otherwise, poll for events if nobody did it for N microseconds
+ * -q N  queue at most N works of each priority (default is unbounded)
+ * -d P  and then drop the new (t), the oldest (h) or random works (r)
+ * -r N  process packets handed off between parts right away, nesting at
+ *       most N times
+ * -b N  and for at most N microseconds (default 50)
+ * -T    keep histograms of queueing and processing times
+ * -j N  long jobs of parts yield after N microseconds if others wait
+ * -R N  ignore priorities, queue works in a lock-free ring of N slots
+ * -u    do the socket i/o of transports with io_uring, if kernel can
+ */
+
+static int nthreads = 0;
+static int pin_threads = 0;
+static size_t thread_stack = 0;
+
+static int idle_spin = 0, idle_yield = 0;
+static int event_thread = 0;
+
+static int queue_limit = 0, queue_policy = drop_tail;
+static int direct_depth = 0, direct_budget = 50;
+
+static int io_backend = io_backend_libev;
+
+static int keep_running;
 
 int cloudvpn_boot (int argc, char**argv)
 {
+	int c;
+
+	while ( (c = getopt (argc, argv, "t:ps:f:mi:y:eE:l:q:d:r:b:Tj:R:u") ) != -1) switch (c) {
+		case 't':
+			nthreads = atoi (optarg);
+			if (nthreads < 1 || nthreads > MAX_WORKERS) return 1;
+			break;
+
+		case 'p':
+			pin_threads = 1;
+			break;
+
+		case 's':
+			thread_stack = 1024 * (size_t) atol (optarg);
+			break;
+
+		case 'f':
+			cloudvpn_scheduler_set_steering (1, atoi (optarg) );
+			break;
+
+		case 'm':
+			cloudvpn_scheduler_set_mailboxes (1);
+			break;
+
+		case 'i':
+			idle_spin = atoi (optarg);
+			break;
+
+		case 'y':
+			idle_yield = atoi (optarg);
+			break;
+
+		case 'e':
+			event_thread = 1;
+			break;
+
+		case 'E':
+			if (cloudvpn_event_set_loops (atoi (optarg) ) ) return 1;
+			break;
+
+		case 'l':
+			cloudvpn_scheduler_set_poll_latency (atoi (optarg) );
+			break;
+
+		case 'q':
+			queue_limit = atoi (optarg);
+			break;
+
+		case 'd':
+			switch (*optarg) {
+			case 't':
+				queue_policy = drop_tail;
+				break;
+			case 'h':
+				queue_policy = drop_head;
+				break;
+			case 'r':
+				queue_policy = drop_red;
+				break;
+			default:
+				return 1;
+			}
+			break;
+
+		case 'r':
+			direct_depth = atoi (optarg);
+			break;
+
+		case 'b':
+			direct_budget = atoi (optarg);
+			break;
+
+		case 'T':
+			cloudvpn_scheduler_set_telemetry (1);
+			break;
+
+		case 'j':
+			cloudvpn_scheduler_set_yield_slice (atoi (optarg) );
+			break;
+
+		case 'R':
+			if (cloudvpn_scheduler_set_ring (atoi (optarg) ) ) return 1;
+			break;
+
+		case 'u':
+			io_backend = io_backend_uring;
+			break;
+
+		default:
+			return 1;
+		}
+
+	cloudvpn_scheduler_set_idle_policy (idle_spin, idle_yield);
+	cloudvpn_scheduler_set_limit (-1, queue_limit, queue_policy);
+	cloudvpn_scheduler_set_direct_dispatch (direct_depth, direct_budget);
+
+	/* rings go with event loops, so this must come after -E */
+	cloudvpn_io_set_backend (io_backend);
+
+	/* nothing to hurry if the event loop has own thread */
+	if (event_thread) cloudvpn_scheduler_set_poll_latency (0);
+
+	return 0;
+}
+
+/*
+ * worker pool
+ */
+
+static void* event_loop_thread (void*arg)
+{
+	cloudvpn_event_thread ( (int) (long) arg, &keep_running);
+
+	return 0;
+}
+
+static void* worker_thread (void*arg)
+{
+	if (pin_threads) cl_thread_set_affinity ( (int) (long) arg);
+
+	cloudvpn_scheduler_run (&keep_running);
+
 	return 0;
 }
 
 int cloudvpn_run ()
 {
+	static cl_thread threads[MAX_WORKERS];
+	static cl_thread event_loops[MAX_EVENT_LOOPS];
+	int i, n, nloops, r = 0;
+
+	n = nthreads;
+	if (!n) n = cl_cpu_count();
+	if (n > MAX_WORKERS) n = MAX_WORKERS;
+
+	keep_running = 1;
+
+	nloops = 0;
+	if (event_thread) {
+		for (;nloops < cloudvpn_event_loops();++nloops)
+			if (cl_thread_create (event_loops + nloops, event_loop_thread,
+			                      (void*) (long) nloops, 0) ) {
+				cloudvpn_shutdown (0);
+				while (nloops > 0) cl_thread_join (event_loops[--nloops]);
+				return 1;
+			}
+	} else cloudvpn_schedule_event_poll();
+
+	for (i = 0;i < n;++i)
+		if (cl_thread_create (threads + i, worker_thread,
+		                      (void*) (long) i, thread_stack) ) {
+			/* stop the ones we've already got */
+			cloudvpn_shutdown (0);
+			r = 1;
+			break;
+		}
+
+	while (i > 0) cl_thread_join (threads[--i]);
+
+	while (nloops > 0) cl_thread_join (event_loops[--nloops]);
+
+	return r;
+}
+
+int cloudvpn_shutdown (int respawn)
+{
+	/* respawning isn't supported, don't stop when asked for it */
+	if (respawn) return 1;
+
+	keep_running = 0;
+
+	cloudvpn_scheduler_wakeup_all();
+	cloudvpn_event_wakeup_all();
+
 	return 0;
 }
 
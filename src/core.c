@@ -14,22 +14,35 @@
 
 #include "event.h"
 #include "sched.h"
+#include "packet.h"
+#include "io.h"
+#include "topology.h"
 
 int cloudvpn_core_init()
 {
+	/* slabs and workers need to know this, it can't fail */
+	cl_topology_init();
+
 	if (cloudvpn_event_init() ) return 1;
 	if (cloudvpn_scheduler_init() ) return 2;
 	if (cloudvpn_init_plugins() ) return 3;
 	if (cloudvpn_init_pool() ) return 4;
+	if (cloudvpn_packet_init() ) return 5;
+	if (cloudvpn_io_init() ) return 6;
 	return 0;
 }
 
 int cloudvpn_core_finish()
 {
+	int r = 0;
+
+	/* queued works still hold sockets, packets and events, they go first */
+	if (cloudvpn_scheduler_destroy() ) r = 2;
+	cloudvpn_io_finish();
+	cloudvpn_packet_finish();
 	cloudvpn_finish_pool();
 	cloudvpn_finish_plugins();
-	if (cloudvpn_scheduler_destroy() ) return 2;
 	if (cloudvpn_event_finish() ) return 1;
-	return 0;
+	return r;
 }
 
@@ -14,11 +14,13 @@
 #include "alloc.h"
 #include "mutex.h"
 #include "sched.h"
+#include "clock.h"
+#include "atomic.h"
 
 #define _XOPEN_SOURCE
 #include <ev.h>
 
-static void reload_event_loop();
+static void reload_event_loop (int);
 
 /*
  * because we need something internal in event struct, we will create it with
@@ -31,13 +33,45 @@ static void reload_event_loop();
 
 #define internal(e) ((struct event_internal_data*)(e+1))
 
+typedef enum {change_registration, change_async, change_resume} change_op;
+
+struct event_change {
+	struct event_change*next;
+	struct event*e;
+	change_op op;
+	int queued;
+};
+
+/* place of a timer in the timer wheel, see below */
+struct timer_link {
+	struct event *next, **pprev; /* pprev is 0 if it's not in the wheel */
+	uint64_t expires; /* tick */
+	int level, slot;
+};
+
 struct event_internal_data {
 	union {
 		ev_io w_io;
 		ev_signal w_signal;
-		ev_timer w_timer;
+		struct timer_link timer;
 		/* async events are handled internally by cloudvpn */
 	};
+	/*
+	 * loop that holds the watcher (or timer), all changes are applied
+	 * there. It moves to target only when it's got nothing registered.
+	 */
+	int loop, target;
+
+	/*
+	 * frontend only says whether it wants the event registered, the loop
+	 * compares that to what it really has, and adds/removes the watcher.
+	 */
+	int want, registered;
+
+	int state; /* of persistent event, see below */
+
+	/* every kind of change is queued at most once at a time */
+	struct event_change reg, async, resume;
 };
 
 /*
@@ -45,98 +79,499 @@ struct event_internal_data {
  * whenever it has time for it.
  */
 
+static struct cl_slab* event_slab;
+
+static void init_change (struct event_change*c, struct event*e, change_op op)
+{
+	c->e = e;
+	c->op = op;
+	c->queued = 0;
+}
+
 struct event* cloudvpn_new_event() {
-	return cl_malloc (sizeof (struct event)
-	                  + sizeof (struct event_internal_data) );
+	struct event*e = cl_slab_alloc (event_slab);
+	struct event_internal_data*i;
+
+	if (e) {
+		e->is_persistent = 0;
+		e->release = 0;
+		e->affinity = -1;
+
+		i = internal (e);
+		i->loop = i->target = 0;
+		i->want = i->registered = 0;
+		i->state = 0;
+		init_change (& (i->reg), e, change_registration);
+		init_change (& (i->async), e, change_async);
+		init_change (& (i->resume), e, change_resume);
+	}
+	return e;
 }
 
 void cloudvpn_delete_event (struct event*e)
 {
-	cl_free (e);
+	cl_slab_free (event_slab, e);
 }
 
-typedef enum {add, remove, send_async} eventlist_op;
+/*
+ * Timers don't go to libev, every loop keeps them in a hierarchical timing
+ * wheel, so that adding and removing a timer is O(1) however many of them
+ * there are. Time is cut into ticks of WHEEL_TICK. Level 0 has a slot for
+ * each of the next WHEEL_SLOTS ticks, a slot of level 1 holds the timers of
+ * WHEEL_SLOTS ticks that come after them, and so on. When the time gets to a
+ * slot of upper level, its timers get moved (cascaded) to lower levels.
+ *
+ * Timers that expire in the same tick fire together, and their works are
+ * scheduled in batches. libev only sees one timer for each loop, set to the
+ * nearest tick when something happens in the wheel.
+ */
 
-struct eventlist {
-	struct event*e;
-	struct eventlist*next;
-	eventlist_op op;
+#define WHEEL_TICK 1000 /* microseconds */
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_WORDS (WHEEL_SLOTS / 64)
+#define WHEEL_LEVELS 4 /* 49 days, longer timers wait in top level */
+
+#define TIMER_BATCH 32 /* works scheduled at once */
+
+struct timer_wheel {
+	uint64_t tick; /* next one to expire, its upper slots are cascaded */
+	uint64_t armed; /* tick the libev timer is set to */
+	int count;
+
+	struct event* slot[WHEEL_LEVELS][WHEEL_SLOTS];
+	uint64_t used[WHEEL_LEVELS][WHEEL_WORDS]; /* bitmap of nonempty slots */
 };
 
-static struct eventlist* event_change_queue;
-static cl_mutex ecq_mutex;
+static void wheel_link (struct timer_wheel*t, struct event*e)
+{
+	struct timer_link*k = & (internal (e)->timer);
+	struct event**head;
+	uint64_t x, d;
+	int level;
+
+	x = k->expires < t->tick ? t->tick : k->expires;
+	d = x - t->tick;
+
+	for (level = 0;level < WHEEL_LEVELS - 1;++level)
+		if (! (d >> (WHEEL_BITS * (level + 1) ) ) ) break;
+
+	/* too far, it will get here again when the top slot is cascaded */
+	if (d >> (WHEEL_BITS * WHEEL_LEVELS) )
+		x = t->tick + ( (uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS) ) - 1;
 
-static int push_event_change (eventlist_op op, struct event*e)
+	k->level = level;
+	k->slot = (x >> (WHEEL_BITS * level) ) & WHEEL_MASK;
+
+	head = t->slot[level] + k->slot;
+	k->next = *head;
+	k->pprev = head;
+	if (k->next) internal (k->next)->timer.pprev = & (k->next);
+	*head = e;
+
+	t->used[level][k->slot / 64] |= (uint64_t) 1 << (k->slot % 64);
+}
+
+static void wheel_unlink (struct timer_wheel*t, struct event*e)
 {
-	/* insert event to registration queue */
-	struct eventlist*ne;
+	struct timer_link*k = & (internal (e)->timer);
+
+	*k->pprev = k->next;
+	if (k->next) internal (k->next)->timer.pprev = k->pprev;
+	k->pprev = 0;
 
-	ne = cl_malloc (sizeof (struct eventlist) );
+	if (!t->slot[k->level][k->slot])
+		t->used[k->level][k->slot / 64] &= ~ ( (uint64_t) 1 << (k->slot % 64) );
+}
 
-	if (!ne) return 1;
+static struct event* wheel_take (struct timer_wheel*t, int level, int slot)
+{
+	/* empties the slot, the timers stay chained by next */
 
-	ne->e = e;
-	ne->op = op;
+	struct event*list = t->slot[level][slot];
 
-	cl_mutex_lock (ecq_mutex);
+	t->slot[level][slot] = 0;
+	t->used[level][slot / 64] &= ~ ( (uint64_t) 1 << (slot % 64) );
 
-	ne->next = event_change_queue;
-	event_change_queue = ne;
+	return list;
+}
 
-	cl_mutex_unlock (ecq_mutex);
+static int next_used (uint64_t*used, int i)
+{
+	/* how far is the first nonempty slot from slot i, going round */
 
-	reload_event_loop();
+	uint64_t m;
+	int k, w;
 
-	return 0;
+	for (k = 0;k <= WHEEL_WORDS;++k) {
+		w = ( (i / 64) + k) % WHEEL_WORDS;
+		m = used[w];
+		if (!k) m &= ~ (uint64_t) 0 << (i % 64);
+		else if (k == WHEEL_WORDS) m &= ( (uint64_t) 1 << (i % 64) ) - 1;
+		if (m) return (w * 64 + __builtin_ctzll (m) - i) & WHEEL_MASK;
+	}
+
+	return -1;
+}
+
+static uint64_t wheel_next (struct timer_wheel*t)
+{
+	/* nearest tick when a slot expires or gets cascaded */
+
+	uint64_t next = ~ (uint64_t) 0, at;
+	int level, shift, d;
+
+	for (level = 0;level < WHEEL_LEVELS;++level) {
+		shift = WHEEL_BITS * level;
+
+		/* slot of upper level that we're in is cascaded already */
+		at = (t->tick >> shift) + (level ? 1 : 0);
+
+		d = next_used (t->used[level], at & WHEEL_MASK);
+		if (d < 0) continue;
+
+		at = (at + d) << shift;
+		if (at < next) next = at;
+	}
+
+	return next;
+}
+
+static void wheel_advance (struct timer_wheel*t, uint64_t limit)
+{
+	/*
+	 * move to the next tick where something happens, but not past limit.
+	 * Slots passed on the way are empty, so nothing gets skipped.
+	 */
+
+	struct event *list, *e;
+	uint64_t next;
+	int level, slot;
+
+	next = wheel_next (t);
+	t->tick = next < limit ? next : limit;
+
+	for (level = 1;level < WHEEL_LEVELS;++level) {
+		if (t->tick & ( ( (uint64_t) 1 << (WHEEL_BITS * level) ) - 1) ) break;
+
+		slot = (t->tick >> (WHEEL_BITS * level) ) & WHEEL_MASK;
+		list = wheel_take (t, level, slot);
+		while ( (e = list) ) {
+			list = internal (e)->timer.next;
+			wheel_link (t, e);
+		}
+	}
+}
+
+/*
+ * Every event loop has its own libev loop and change queue, so they don't
+ * share anything. Loop 0 is the libev default loop, which is the only one
+ * that can watch signals.
+ *
+ * Change queue is the intrusive MPSC queue by Dmitry Vyukov. Producers only
+ * swap the head, the loop takes the changes from the tail in the order they
+ * were pushed. Stub node keeps the queue never really empty, so producers
+ * don't have to care about the tail at all.
+ */
+
+struct event_loop {
+	cl_mutex core_mutex; /* held by the thread that runs the loop */
+	struct ev_loop* loop;
+	ev_async async;
+	ev_timer wait_timer; /* bounds the wait of cloudvpn_wait_for_event */
+
+	struct timer_wheel wheel;
+	ev_timer wheel_timer;
+
+	struct event_change *cq_head, *cq_tail, cq_stub;
+
+	struct event_loop_stats stats;
+	uint64_t last_loop_end;
+};
+
+static struct event_loop loops[MAX_EVENT_LOOPS];
+static int nloops = 0;
+
+static int choose_loop (struct event*e)
+{
+	uintptr_t h;
+
+	if (e->data.type == event_signal || nloops == 1) return 0;
+
+	if (e->affinity >= 0) return e->affinity % nloops;
+
+	/* pointers are aligned, so drop some low bits */
+	h = (uintptr_t) e->data.owner;
+	return (h >> 4) % nloops;
+}
+
+static void cq_push (struct event_loop*l, struct event_change*c)
+{
+	struct event_change*prev;
+
+	c->next = 0;
+
+	do prev = cl_atomic_read (&l->cq_head);
+	while (!cl_atomic_cas (&l->cq_head, prev, c) );
+
+	/* until this, consumer sees the queue end at prev */
+	prev->next = c;
+}
+
+static struct event_change* cq_pop (struct event_loop*l)
+{
+	/* only for the thread that runs the loop */
+
+	struct event_change *tail, *next;
+
+	tail = l->cq_tail;
+	next = cl_atomic_read (&tail->next);
+
+	if (tail == & (l->cq_stub) ) {
+		if (!next) return 0;
+		l->cq_tail = tail = next;
+		next = cl_atomic_read (&next->next);
+	}
+
+	if (next) {
+		l->cq_tail = next;
+		return tail;
+	}
+
+	/* producer is in the middle of push, get it the next time */
+	if (tail != cl_atomic_read (&l->cq_head) ) return 0;
+
+	/* tail is the last one, put stub behind it so it can be taken */
+	cq_push (l, & (l->cq_stub) );
+
+	next = cl_atomic_read (&tail->next);
+	if (!next) return 0;
+
+	l->cq_tail = next;
+	return tail;
+}
+
+static void queue_event_change (struct event_change*c)
+{
+	int i = cl_atomic_read (&internal (c->e)->loop);
+
+	/* it's in the queue already, and will see the newest state */
+	if (!cl_atomic_cas (&c->queued, 0, 1) ) return;
+
+	cq_push (loops + i, c);
+
+	reload_event_loop (i);
+}
+
+static void want_registered (struct event*e, int want)
+{
+	struct event_internal_data*i = internal (e);
+
+	/*
+	 * the loop that has the event moves it, once it's removed there, so
+	 * that a change queued meanwhile can't land elsewhere
+	 */
+	if (want) i->target = choose_loop (e);
+
+	i->want = want;
+	cl_barrier();
+
+	queue_event_change (& (i->reg) );
 }
 
 int cloudvpn_register_event (struct event*e)
 {
-	return push_event_change (add, e);
+	want_registered (e, 1);
+	return 0;
 }
 
 int cloudvpn_unregister_event (struct event*e)
 {
-	return push_event_change (remove, e);
+	want_registered (e, 0);
+	return 0;
 }
 
 int cloudvpn_event_send_async (struct event*e)
 {
-	return push_event_change (send_async, e);
+	/* sends that come before the loop gets to it are merged */
+
+	internal (e)->loop = choose_loop (e);
+	queue_event_change (& (internal (e)->async) );
+	return 0;
 }
 
 /*
- * event core functions
+ * Persistent events. The state says who holds the event:
+ *
+ * busy - there's a work for it somewhere in the scheduler
+ * disabled - owner doesn't want it to fire
+ * removed - it got unregistered
+ *
+ * Event is armed if it's neither of these. When the watcher fires and the
+ * event isn't armed, loop stops the watcher and marks the event suspended.
+ * Whoever then makes the event armed again queues a resume for the loop,
+ * which starts the watcher again. So the watcher isn't touched at all while
+ * the works are processed faster than the fd gets ready again.
+ *
+ * Unregistered event is freed by whoever drops the last reference, that is
+ * the busy work or the queued resume.
  */
 
-static cl_mutex eventcore_mutex;
-static struct ev_loop* loop;
-static ev_async async;
+#define EVENT_BUSY 1
+#define EVENT_DISABLED 2
+#define EVENT_REMOVED 4
+#define EVENT_SUSPENDED 8
+#define EVENT_RESUMING 16
+
+#define armed(s) (! ( (s) & (EVENT_BUSY | EVENT_DISABLED | EVENT_REMOVED) ) )
+
+static void release_event (struct event*e)
+{
+	if (e->release) e->release (e);
+	else if (!e->is_static) cloudvpn_delete_event (e);
+}
+
+static void clear_event_state (struct event*e, int flag)
+{
+	struct event_internal_data*i = internal (e);
+	int s, n, resuming;
+
+	do {
+		s = cl_atomic_read (&i->state);
+		n = s & ~flag;
+		resuming = (s & EVENT_SUSPENDED) && armed (n);
+		if (resuming) n = (n & ~EVENT_SUSPENDED) | EVENT_RESUMING;
+	} while (!cl_atomic_cas (&i->state, s, n) );
+
+	if (resuming) queue_event_change (& (i->resume) );
+	else if ( (n & EVENT_REMOVED)
+	            && ! (n & (EVENT_BUSY | EVENT_RESUMING) ) ) release_event (e);
+}
+
+void cloudvpn_event_disable (struct event*e)
+{
+	/* watcher gets stopped only if it fires */
+
+	struct event_internal_data*i = internal (e);
+	int s;
+
+	do s = cl_atomic_read (&i->state);
+	while (!cl_atomic_cas (&i->state, s, s | EVENT_DISABLED) );
+}
+
+void cloudvpn_event_enable (struct event*e)
+{
+	clear_event_state (e, EVENT_DISABLED);
+}
+
+void cloudvpn_event_done (struct event*e)
+{
+	clear_event_state (e, EVENT_BUSY);
+}
+
+/*
+ * event core functions
+ */
 
 static void null_async_callback (EV_P_ ev_async*w, int revents) {}
+static void null_timer_callback (EV_P_ ev_timer*w, int revents) {}
+static void wheel_timer_callback (EV_P_ ev_timer*w, int revents);
 
-static void reload_event_loop()
+static void reload_event_loop (int i)
 {
 	/* asynchronously interrupt sleep so libev can update itself */
-	ev_async_send (loop, &async);
+	ev_async_send (loops[i].loop, & (loops[i].async) );
+}
+
+void cloudvpn_event_wakeup (int i)
+{
+	if (i >= 0 && i < nloops) reload_event_loop (i);
+}
+
+void cloudvpn_event_wakeup_all()
+{
+	int i;
+
+	for (i = 0;i < nloops;++i) reload_event_loop (i);
+}
+
+static int loop_init (struct event_loop*l, int i)
+{
+	l->loop = i ? ev_loop_new (EVFLAG_AUTO) : ev_default_loop (0);
+	if (!l->loop) return 1;
+
+	ev_async_init (& (l->async), null_async_callback);
+	ev_async_start (l->loop, & (l->async) );
+
+	ev_timer_init (& (l->wait_timer), null_timer_callback, 0, 0);
+
+	memset (& (l->wheel), 0, sizeof (struct timer_wheel) );
+	ev_timer_init (& (l->wheel_timer), wheel_timer_callback, 0, 0);
+	l->wheel_timer.data = l;
+
+	l->cq_stub.next = 0;
+	l->cq_head = l->cq_tail = & (l->cq_stub);
+	memset (& (l->stats), 0, sizeof (struct event_loop_stats) );
+	l->last_loop_end = 0;
+
+	if (cl_mutex_init (&l->core_mutex) ) {
+		if (i) ev_loop_destroy (l->loop);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int loop_finish (struct event_loop*l, int i)
+{
+	int r = cl_mutex_destroy (l->core_mutex);
+
+	if (i) ev_loop_destroy (l->loop);
+
+	return r;
+}
+
+int cloudvpn_event_set_loops (int n)
+{
+	/* can only add the loops, before anything is registered */
+
+	if (n > MAX_EVENT_LOOPS) return 1;
+
+	for (;nloops < n;++nloops)
+		if (loop_init (loops + nloops, nloops) ) return 1;
+
+	return 0;
+}
+
+int cloudvpn_event_loops()
+{
+	return nloops;
 }
 
 int cloudvpn_event_init()
 {
-	loop = ev_default_loop (0);
+	event_slab = cl_slab_create (sizeof (struct event)
+	                             + sizeof (struct event_internal_data) );
+	if (!event_slab) return 1;
 
-	ev_async_init (&async, null_async_callback);
-	ev_async_start (loop, &async);
+	nloops = 0;
 
-	return (!loop)
-	       || cl_mutex_init (&eventcore_mutex)
-	       || cl_mutex_init (&ecq_mutex);
+	return cloudvpn_event_set_loops (1);
 }
 
 int cloudvpn_event_finish()
 {
-	return cl_mutex_destroy (eventcore_mutex)
-	       || cl_mutex_destroy (ecq_mutex);
+	int r = 0;
+
+	while (nloops > 0) {
+		--nloops;
+		r |= loop_finish (loops + nloops, nloops);
+	}
+
+	cl_slab_destroy (event_slab);
+
+	return r;
 }
 
 /*
@@ -145,30 +580,57 @@ int cloudvpn_event_finish()
  * I would totally do a template lol.
  */
 
-static int schedule_event (struct event*e);
+static int schedule_event (struct ev_loop*loop, struct event*e);
 
 static void libev_io_cb (struct ev_loop *loop, ev_io *w, int revents)
 {
 	struct event*e;
 	e = w->data;
 
-	schedule_event (e);
+	schedule_event (loop, e);
 }
 
-static void libev_timer_cb (struct ev_loop *loop, ev_timer *w, int revents)
+static void libev_signal_cb (struct ev_loop *loop, ev_signal *w, int revents)
 {
 	struct event*e;
 	e = w->data;
 
-	schedule_event (e);
+	schedule_event (loop, e);
 }
 
-static void libev_signal_cb (struct ev_loop *loop, ev_signal *w, int revents)
+/*
+ * timers in the wheel of the loop where they got registered
+ */
+
+static void timer_start (struct event*e)
 {
-	struct event*e;
-	e = w->data;
+	struct timer_wheel*t = & (loops[internal (e)->loop].wheel);
+	struct timer_link*k = & (internal (e)->timer);
+	uint64_t now;
+
+	/* already running, like with ev_timer_start */
+	if (k->pprev) return;
+
+	now = cl_clock_usec();
+
+	/* empty wheel can just jump to the present */
+	if (!t->count && t->tick < now / WHEEL_TICK) t->tick = now / WHEEL_TICK;
+
+	/* rounded up, so it never fires early */
+	k->expires = (now + e->data.time + WHEEL_TICK - 1) / WHEEL_TICK;
+
+	wheel_link (t, e);
+	++t->count;
+}
 
-	schedule_event (e);
+static void timer_stop (struct event*e)
+{
+	struct timer_wheel*t = & (loops[internal (e)->loop].wheel);
+
+	if (!internal (e)->timer.pprev) return;
+
+	wheel_unlink (t, e);
+	--t->count;
 }
 
 /*
@@ -176,7 +638,28 @@ static void libev_signal_cb (struct ev_loop *loop, ev_signal *w, int revents)
  * loop is guaranteed not to be running
  */
 
-static void add_handler (struct event*e)
+static void start_handler (struct ev_loop*loop, struct event*e)
+{
+	struct event_internal_data*i;
+	i = internal (e);
+
+	switch (e->data.type) {
+	case event_time:
+		timer_start (e);
+		break;
+
+	case event_signal:
+		ev_signal_start (loop, & (i->w_signal) );
+		break;
+
+	case event_fd_writeable:
+	case event_fd_readable:
+		ev_io_start (loop, & (i->w_io) );
+		break;
+	}
+}
+
+static void add_handler (struct ev_loop*loop, struct event*e)
 {
 	struct event_internal_data*i;
 	i = internal (e);
@@ -184,37 +667,40 @@ static void add_handler (struct event*e)
 	switch (e->data.type) {
 
 	case event_time:
-		ev_timer_init (& (i->w_timer), libev_timer_cb,
-		               0.000001f*e->data.time, 0);
-		ev_timer_start (loop, & (i->w_timer) );
+		i->timer.pprev = 0;
 		break;
 
 	case event_signal:
 		ev_signal_init (& (i->w_signal), libev_signal_cb,
 		                e->data.signal);
-		ev_signal_start (loop, & (i->w_signal) );
+		i->w_signal.data = e;
 		break;
 
 	case event_fd_writeable:
 		ev_io_init (& (i->w_io), libev_io_cb, e->data.fd, EV_WRITE);
-		ev_io_start (loop, & (i->w_io) );
+		i->w_io.data = e;
 		break;
 
 	case event_fd_readable:
 		ev_io_init (& (i->w_io), libev_io_cb, e->data.fd, EV_READ);
-		ev_io_start (loop, & (i->w_io) );
+		i->w_io.data = e;
 		break;
+
+	default:
+		return;
 	}
+
+	start_handler (loop, e);
 }
 
-static void remove_handler (struct event*e)
+static void remove_handler (struct ev_loop*loop, struct event*e)
 {
 	struct event_internal_data*i;
 	i = internal (e);
 
 	switch (e->data.type) {
 	case event_time:
-		ev_timer_stop (loop, & (i->w_timer) );
+		timer_stop (e);
 		break;
 
 	case event_signal:
@@ -232,14 +718,15 @@ static void remove_handler (struct event*e)
  * event processing stuff
  */
 
-static void cleanup_event (struct event*e)
+static void cleanup_event (struct ev_loop*loop, struct event*e)
 {
 	/*
 	 * always remove the handler, so it doesn't trigger again in next
 	 * thread (faster than event level-trigger is handled)
 	 */
 
-	remove_handler (e);
+	remove_handler (loop, e);
+	internal (e)->registered = 0;
 
 	if (!e->is_static) {
 
@@ -247,13 +734,102 @@ static void cleanup_event (struct event*e)
 	}
 }
 
-static int schedule_event (struct event*e)
+static int make_busy (struct ev_loop*loop, struct event*e)
+{
+	/* if persistent event isn't armed, suspend it instead */
+
+	struct event_internal_data*i = internal (e);
+	int s, n;
+
+	do {
+		s = cl_atomic_read (&i->state);
+		n = armed (s) ? s | EVENT_BUSY : s | EVENT_SUSPENDED;
+	} while (!cl_atomic_cas (&i->state, s, n) );
+
+	if (armed (s) ) return 1;
+
+	remove_handler (loop, e);
+	return 0;
+}
+
+static void remove_persistent (struct ev_loop*loop, struct event*e)
+{
+	struct event_internal_data*i = internal (e);
+	int s;
+
+	remove_handler (loop, e);
+
+	do s = cl_atomic_read (&i->state);
+	while (!cl_atomic_cas (&i->state, s, s | EVENT_REMOVED) );
+
+	if (! (s & (EVENT_BUSY | EVENT_RESUMING) ) ) release_event (e);
+}
+
+static void resume_persistent (struct ev_loop*loop, struct event*e)
+{
+	struct event_internal_data*i = internal (e);
+	int s, n;
+
+	/* it might have got disabled or removed since the resume was queued */
+	do {
+		s = cl_atomic_read (&i->state);
+		n = s & ~EVENT_RESUMING;
+		if (!armed (s) ) n |= EVENT_SUSPENDED;
+	} while (!cl_atomic_cas (&i->state, s, n) );
+
+	if (armed (s) ) start_handler (loop, e);
+	else if ( (s & EVENT_REMOVED) && ! (s & EVENT_BUSY) ) release_event (e);
+}
+
+static void update_registration (struct event_loop*l, struct event*e)
+{
+	struct event_internal_data*i = internal (e);
+	struct ev_loop*loop = l->loop;
+	int s;
+
+	if (cl_atomic_read (&i->want) == i->registered) return;
+
+	/* fresh add that belongs elsewhere, nothing of it is here anymore */
+	if (!i->registered && i->target != l - loops) {
+		i->loop = i->target;
+		cl_barrier();
+		queue_event_change (& (i->reg) );
+		return;
+	}
+
+	i->registered = !i->registered;
+
+	if (!i->registered) {
+		if (e->is_persistent) remove_persistent (loop, e);
+		else remove_handler (loop, e);
+		return;
+	}
+
+	/* persistent event may still be busy from before it got removed */
+	do s = cl_atomic_read (&i->state);
+	while (!cl_atomic_cas (&i->state, s,
+	                       s & ~ (EVENT_REMOVED | EVENT_SUSPENDED) ) );
+
+	add_handler (loop, e);
+}
+
+static struct work* event_work (struct ev_loop*loop, struct event*e)
 {
+	/* work for the fired event, or 0 if there's nothing to schedule */
+
 	struct work*w;
+	int persistent;
+
+	persistent = e->is_persistent && e->data.type != event_async;
+
+	if (persistent && !make_busy (loop, e) ) return 0;
 
 	w = cloudvpn_new_work();
 
-	if (!w) return 1;
+	if (!w) {
+		if (persistent) cloudvpn_event_done (e);
+		return 0;
+	}
 
 	w->type = work_event;
 	w->priority = e->priority;
@@ -261,55 +837,217 @@ static int schedule_event (struct event*e)
 
 	memcpy (&w->e, &e->data, sizeof (struct event_data) );
 
-	cleanup_event (e);
+	if (persistent) w->ev = e;
+	else cleanup_event (loop, e);
+
+	return w;
+}
+
+static int schedule_event (struct ev_loop*loop, struct event*e)
+{
+	struct work*w = event_work (loop, e);
+
+	return w ? cloudvpn_schedule_work (w) : 1;
+}
+
+/*
+ * timer wheel processing
+ */
+
+static void wheel_expire (struct event_loop*l)
+{
+	struct timer_wheel*t = & (l->wheel);
+	struct work*batch[TIMER_BATCH];
+	struct event *list, *e;
+	struct work*w;
+	uint64_t now;
+	int n = 0;
+
+	now = cl_clock_usec() / WHEEL_TICK;
+
+	while (t->count && t->tick <= now) {
+		list = wheel_take (t, 0, t->tick & WHEEL_MASK);
+
+		/* timers that start again below go behind this tick */
+		wheel_advance (t, now + 1);
+
+		while ( (e = list) ) {
+			list = internal (e)->timer.next;
+			internal (e)->timer.pprev = 0;
+			--t->count;
+
+			/* persistent ones repeat, suspending stops them */
+			if (e->is_persistent) timer_start (e);
+
+			if (! (w = event_work (l->loop, e) ) ) continue;
+
+			batch[n++] = w;
+			if (n == TIMER_BATCH) {
+				cloudvpn_schedule_work_batch (batch, n);
+				n = 0;
+			}
+		}
+	}
+
+	if (n) cloudvpn_schedule_work_batch (batch, n);
+}
+
+static void wheel_arm (struct event_loop*l)
+{
+	/* point the libev timer to the next thing to do in the wheel */
+
+	struct timer_wheel*t = & (l->wheel);
+	uint64_t next, now;
+
+	if (!t->count) {
+		ev_timer_stop (l->loop, & (l->wheel_timer) );
+		return;
+	}
+
+	next = wheel_next (t);
+	if (next == t->armed && ev_is_active (& (l->wheel_timer) ) ) return;
+	t->armed = next;
+
+	now = cl_clock_usec();
+	next *= WHEEL_TICK;
+
+	ev_timer_stop (l->loop, & (l->wheel_timer) );
+	ev_timer_set (& (l->wheel_timer),
+	              next > now ? 0.000001 * (next - now) : 0, 0);
+	ev_timer_start (l->loop, & (l->wheel_timer) );
+}
+
+static void wheel_timer_callback (EV_P_ ev_timer*w, int revents)
+{
+	struct event_loop*l = w->data;
 
-	return cloudvpn_schedule_work (w);
+	wheel_expire (l);
+	wheel_arm (l);
 }
 
 /*
  * event waiting frontend
+ *
+ * Event loop lag is the time between two runs of the event loop, when nobody
+ * is watching the fds. We measure it from the end of one run to the start of
+ * the next one.
  */
 
-void cloudvpn_wait_for_event()
+static void run_event_loop (struct event_loop*l, int flags)
 {
 	int created_async_work;
+	uint64_t now;
+	struct event_change*c;
 
-	/* don't block if there's already other thread waiting */
-	if (cl_mutex_trylock (eventcore_mutex) ) return;
+	now = cl_clock_usec();
 
-	/* load stuff from frontend, put it to ev, wait for it. */
+	if (l->last_loop_end) {
+		l->stats.last_lag = now - l->last_loop_end;
+		l->stats.total_lag += l->stats.last_lag;
+		if (l->stats.last_lag > l->stats.max_lag)
+			l->stats.max_lag = l->stats.last_lag;
+	}
+
+	++l->stats.runs;
 
-	cl_mutex_lock (ecq_mutex);
+	/* load stuff from frontend, put it to ev, wait for it. */
 
 	created_async_work = 0;
 
-	/* i'm so lazy */
-#	define q event_change_queue
+	while ( (c = cq_pop (l) ) ) {
+		/*
+		 * new change of the same kind can be queued from now on. The
+		 * event may get freed below, together with c.
+		 */
+		c->queued = 0;
+		cl_barrier();
+
+		/* event moved to other loop since it was queued here */
+		if (c->op != change_async
+		        && cl_atomic_read (&internal (c->e)->loop) != l - loops) {
+			queue_event_change (c);
+			continue;
+		}
 
-	while (q) {
-		switch (q->op) {
-		case add:
-			add_handler (q->e);
-			break;
-		case remove:
-			remove_handler (q->e);
+		switch (c->op) {
+		case change_registration:
+			update_registration (l, c->e);
 			break;
-		case send_async:
-			schedule_event (q->e);
+		case change_async:
+			schedule_event (l->loop, c->e);
 			++created_async_work;
 			break;
+		case change_resume:
+			resume_persistent (l->loop, c->e);
+			break;
 		}
-		q = q->next;
 	}
 
-#	undef q
-
-	cl_mutex_unlock (ecq_mutex);
+	wheel_arm (l);
 
 	/* don't wait if it seems that we have other work to do. */
 	if (!created_async_work)
-		ev_loop (loop, EVLOOP_ONESHOT);
+		ev_loop (l->loop, flags);
+
+	l->last_loop_end = cl_clock_usec();
+}
+
+void cloudvpn_wait_for_event (int i)
+{
+	cloudvpn_wait_for_event_until (i, 0);
+}
+
+void cloudvpn_wait_for_event_until (int i, uint64_t t)
+{
+	/* wait for events, but not after t (if it's nonzero) */
+
+	uint64_t now;
+	struct event_loop*l = loops + i;
+
+	/* don't block if there's already other thread waiting */
+	if (cl_mutex_trylock (l->core_mutex) ) return;
 
-	cl_mutex_unlock (eventcore_mutex);
+	if (t) {
+		now = cl_clock_usec();
+		ev_timer_set (& (l->wait_timer),
+		              t > now ? 0.000001 * (t - now) : 0, 0);
+		ev_timer_start (l->loop, & (l->wait_timer) );
+	}
+
+	run_event_loop (l, EVLOOP_ONESHOT);
+
+	if (t) ev_timer_stop (l->loop, & (l->wait_timer) );
+
+	cl_mutex_unlock (l->core_mutex);
+}
+
+void cloudvpn_poll_event (int i)
+{
+	struct event_loop*l = loops + i;
+
+	if (cl_mutex_trylock (l->core_mutex) ) return;
+
+	run_event_loop (l, EVLOOP_NONBLOCK);
+
+	cl_mutex_unlock (l->core_mutex);
 }
 
+void cloudvpn_event_thread (int i, int*keep_running)
+{
+	struct event_loop*l = loops + i;
+
+	while (*keep_running) {
+		cl_mutex_lock (l->core_mutex);
+		run_event_loop (l, EVLOOP_ONESHOT);
+		cl_mutex_unlock (l->core_mutex);
+	}
+}
+
+int cloudvpn_event_loop_stats (int i, struct event_loop_stats*s)
+{
+	if (i < 0 || i >= nloops) return 1;
+
+	memcpy (s, & (loops[i].stats), sizeof (struct event_loop_stats) );
+
+	return 0;
+}
@@ -0,0 +1,1092 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "io.h"
+#include "alloc.h"
+#include "atomic.h"
+#include "mutex.h"
+#include "event.h"
+#include "sched.h"
+#include "plugin.h"
+#include "pool.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+/* headers older than 6.0 lack multishot receive and buffer rings */
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/*
+ * Both backends work without any help of the parts: the core has internal
+ * parts (that are in no pool) with process_work that does the i/o. With
+ * libev, every io socket has a persistent readable event, and the worker
+ * that gets it reads the socket until it would block. Sends are done right
+ * away by the sender, and if the socket gets full, they wait for the
+ * writable event.
+ *
+ * With io_uring, there's one ring for each event loop. Sockets use the ring
+ * of the loop their owner's events go to. Everything is read by multishot
+ * receives, into buffers picked from a ring of buffers that we provide;
+ * the buffers are then just handed over to packets, and replaced by new
+ * ones. Completions are reaped by whoever gets the persistent readable
+ * event of ring fd, so there's only one reaper of a ring at a time.
+ * Submissions are only queued by the senders, and the queue is submitted by
+ * a static work, so all sends from the works that run before it go to
+ * kernel in one syscall.
+ *
+ * Sockets are counted by references: the owner holds one until it closes
+ * the socket, the receiving holds one (until the last completion of the
+ * receive, or until the readable event is released), every delivered work
+ * holds one until it's deleted, and with io_uring, the send in flight holds
+ * one.
+ */
+
+#define IO_BATCH 32 /* works scheduled at once */
+#define IO_BUF_SIZE 2048 /* one datagram, or a chunk of stream */
+
+struct io_request {
+	struct io_request*next;
+	struct io_socket*s;
+	struct packet*p;
+	int off; /* bytes already sent */
+};
+
+struct io_ring;
+
+struct io_socket {
+	int fd;
+	struct part*owner;
+	int priority;
+
+	int refs;
+	int closing;
+	int receiving; /* 0 not yet, 1 receives, 2 ended, 3 being cancelled */
+
+	struct io_ring*r; /* 0 with libev backend */
+	uint64_t recv_tag; /* user_data of the multishot receive */
+
+	/* libev backend */
+	struct event *rd, *wr;
+	int wr_state; /* 0 not registered, 1 registered, 2 closed */
+
+	/* sends go out in order, one after another */
+	cl_mutex m;
+	struct io_request *sendq, **sendq_tail;
+	int flushing; /* somebody is sending the queue, or it's in the ring */
+	int blocked; /* libev sender waits for writable event to go on */
+};
+
+static int backend = io_backend_libev;
+
+static struct cl_slab *socket_slab, *request_slab;
+
+static void socket_process_work (struct part*, struct work*);
+static void ring_process_work (struct part*, struct work*);
+
+static struct plugin socket_plugin = {"io socket", 0, socket_process_work, 0, 0};
+static struct part socket_part = {&socket_plugin, 0, 0, 0, 0};
+
+static struct plugin ring_plugin = {"io ring", 0, ring_process_work, 0, 0};
+static struct part ring_part = {&ring_plugin, 0, 0, 0, 0};
+
+/*
+ * common stuff
+ */
+
+static struct io_request* request_new (struct io_socket*s, struct packet*p)
+{
+	struct io_request*q = cl_slab_alloc (request_slab);
+	if (q) {
+		q->next = 0;
+		q->s = s;
+		q->p = p;
+		q->off = 0;
+	}
+	return q;
+}
+
+static void request_free (struct io_request*q)
+{
+	cloudvpn_packet_free (q->p);
+	cl_slab_free (request_slab, q);
+}
+
+static void socket_unref (struct io_socket*s)
+{
+	struct io_request*q;
+
+	if (cl_atomic_sub (&s->refs, 1) ) return;
+
+	while ( (q = s->sendq) ) {
+		s->sendq = q->next;
+		request_free (q);
+	}
+
+	if (s->rd) cloudvpn_delete_event (s->rd);
+	if (s->wr) cloudvpn_delete_event (s->wr);
+	cl_mutex_destroy (s->m);
+
+	close (s->fd);
+	cl_slab_free (socket_slab, s);
+}
+
+static void deliver (struct work**batch, int*n,
+                     struct io_socket*s, struct packet*p, int result)
+{
+	struct work*w;
+
+	w = cloudvpn_new_work();
+	if (!w) {
+		if (p) cloudvpn_packet_free (p);
+		return;
+	}
+
+	cl_atomic_add (&s->refs, 1);
+
+	w->type = work_io;
+	w->priority = s->priority;
+	w->is_static = 0;
+	w->io.owner = s->owner;
+	w->io.s = s;
+	w->io.p = p;
+	w->io.result = result;
+
+	batch[ (*n) ++] = w;
+
+	if (*n == IO_BATCH) {
+		cloudvpn_schedule_work_batch (batch, *n);
+		*n = 0;
+	}
+}
+
+static int owner_loop (struct part*owner)
+{
+	/* same as event loops choose by owner, see event.c */
+	return ( (uintptr_t) owner >> 4) % cloudvpn_event_loops();
+}
+
+/*
+ * io_uring backend
+ */
+
+#ifdef HAVE_URING
+
+#define RING_ENTRIES 256
+#define RING_BUFS 256 /* must be a power of 2 */
+
+/* what completion is about, in low bits of user_data */
+#define IO_RECV 0
+#define IO_SEND 1
+#define IO_CANCEL 2
+#define IO_TAG 3
+
+/*
+ * receives also carry a generation above the pointer (user space addresses
+ * fit below), so that a late cancel can't hit a new socket at the same
+ * address.
+ */
+#define IO_GEN_SHIFT 48
+#define IO_PTR_MASK ( ( (uint64_t) 1 << IO_GEN_SHIFT) - 1 - IO_TAG)
+
+static unsigned recv_gen;
+
+/* memory shared with kernel, barrier orders the stuff written before */
+#define ring_store(p,v) do { \
+		cl_barrier(); \
+		* (volatile __typeof__ (* (p) ) *) (p) = (v); \
+	} while (0)
+
+struct io_ring {
+	int fd;
+	struct event*cq_event; /* ring fd is readable when there are completions */
+
+	void*mem;
+	size_t mem_size;
+
+	cl_mutex sq_mutex;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, *sq_flags;
+	unsigned sq_entries, sq_local_tail;
+	struct io_uring_sqe*sqes;
+	size_t sqes_size;
+
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe*cqes;
+
+	struct work submit_work;
+	int submit_scheduled;
+
+	/* provided buffers, touched only by the reaper */
+	struct io_uring_buf_ring*br;
+	unsigned short br_tail;
+	char*bufs[RING_BUFS];
+};
+
+static struct io_ring*rings;
+static int nrings = 0;
+
+static void ring_provide (struct io_ring*r, int bid)
+{
+	struct io_uring_buf*b;
+
+	b = r->br->bufs + (r->br_tail & (RING_BUFS - 1) );
+	b->addr = (uintptr_t) r->bufs[bid];
+	b->len = IO_BUF_SIZE;
+	b->bid = bid;
+	++r->br_tail;
+}
+
+static void ring_submit (struct io_ring*r)
+{
+	/* expects sq_mutex */
+
+	unsigned n = r->sq_local_tail - cl_atomic_read (r->sq_head);
+
+	if (!n) return;
+
+	ring_store (r->sq_tail, r->sq_local_tail);
+
+	while (syscall (__NR_io_uring_enter, r->fd, n, 0, 0, 0, 0) < 0
+	        && errno == EINTR);
+}
+
+static struct io_uring_sqe* ring_sqe (struct io_ring*r)
+{
+	/* expects sq_mutex */
+
+	struct io_uring_sqe*sqe;
+	unsigned i;
+
+	if (r->sq_local_tail - cl_atomic_read (r->sq_head) >= r->sq_entries) {
+		/* full, make some room */
+		ring_submit (r);
+		if (r->sq_local_tail - cl_atomic_read (r->sq_head)
+		        >= r->sq_entries) return 0;
+	}
+
+	i = r->sq_local_tail & *r->sq_mask;
+	sqe = r->sqes + i;
+	memset (sqe, 0, sizeof (struct io_uring_sqe) );
+	r->sq_array[i] = i;
+	++r->sq_local_tail;
+
+	return sqe;
+}
+
+static void ring_kick (struct io_ring*r)
+{
+	/* submit the queue after the current work */
+	if (cl_atomic_cas (&r->submit_scheduled, 0, 1) )
+		cloudvpn_schedule_work (& (r->submit_work) );
+}
+
+static int ring_recv (struct io_ring*r, struct io_socket*s)
+{
+	struct io_uring_sqe*sqe;
+
+	cl_mutex_lock (r->sq_mutex);
+
+	sqe = ring_sqe (r);
+	if (sqe) {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = s->fd;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		sqe->user_data = s->recv_tag;
+	}
+
+	cl_mutex_unlock (r->sq_mutex);
+
+	return !sqe;
+}
+
+static int ring_send (struct io_ring*r, struct io_request*q)
+{
+	struct io_uring_sqe*sqe;
+
+	cl_mutex_lock (r->sq_mutex);
+
+	sqe = ring_sqe (r);
+	if (sqe) {
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = q->s->fd;
+		sqe->addr = (uintptr_t) (q->p->data + q->off);
+		sqe->len = q->p->len - q->off;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->user_data = (uintptr_t) q | IO_SEND;
+	}
+
+	cl_mutex_unlock (r->sq_mutex);
+
+	return !sqe;
+}
+
+static void ring_cancel (struct io_ring*r, struct io_socket*s)
+{
+	struct io_uring_sqe*sqe;
+
+	cl_mutex_lock (r->sq_mutex);
+
+	sqe = ring_sqe (r);
+	if (sqe) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = s->recv_tag;
+		sqe->user_data = IO_CANCEL;
+	}
+
+	cl_mutex_unlock (r->sq_mutex);
+
+	ring_kick (r);
+}
+
+static void ring_received (struct io_ring*r, struct io_socket*s,
+                           int res, unsigned flags,
+                           struct work**batch, int*n)
+{
+	struct packet*p;
+	char*buf;
+	int bid, again;
+
+	if (flags & IORING_CQE_F_BUFFER) {
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+		/* packet takes the buffer, and ring gets a new one */
+		p = 0;
+		buf = 0;
+		if (res > 0 && !s->closing && cl_atomic_read (&s->receiving) == 1) {
+			if ( (p = cloudvpn_packet_alloc() )
+			        && (buf = cl_malloc (IO_BUF_SIZE) ) ) {
+				p->data = r->bufs[bid];
+				p->len = res;
+				r->bufs[bid] = buf;
+				deliver (batch, n, s, p, res);
+			} else {
+				/* lost data break the stream, so receiving ends */
+				if (p) cloudvpn_packet_free (p);
+				if (cl_atomic_cas (&s->receiving, 1, 3) ) {
+					deliver (batch, n, s, 0, -ENOMEM);
+					ring_cancel (r, s);
+				}
+			}
+		}
+
+		ring_provide (r, bid);
+	}
+
+	if (flags & IORING_CQE_F_MORE) return;
+
+	/*
+	 * multishot receive has ended, it stops when it runs out of buffers.
+	 * Close decides about cancelling under the lock, so it can't miss
+	 * the receive that goes again.
+	 */
+	cl_mutex_lock (s->m);
+	again = cl_atomic_read (&s->receiving) == 1 && !s->closing
+	        && (res > 0 || res == -ENOBUFS) && !ring_recv (r, s);
+	cl_mutex_unlock (s->m);
+
+	if (again) return;
+
+	/* end is reported once, unless the owner doesn't care anymore */
+	if (cl_atomic_cas (&s->receiving, 1, 2) && !s->closing)
+		deliver (batch, n, s, 0, res);
+
+	s->receiving = 2;
+	socket_unref (s);
+}
+
+static void ring_sent (struct io_ring*r, struct io_request*q, int res)
+{
+	/*
+	 * q is the head of the send queue, and the only send of the socket
+	 * in the ring. The next one goes only after it's done, so that the
+	 * rest of a partial send can't get behind the later ones.
+	 */
+
+	struct io_socket*s = q->s;
+	struct io_request*next;
+
+	/* stream sockets may take just a part */
+	if (res > 0 && (q->off += res) < q->p->len && !s->closing
+	        && !ring_send (r, q) ) return;
+
+	/* failed sends are dropped */
+	for (;;) {
+		cl_mutex_lock (s->m);
+
+		s->sendq = q->next;
+		if (!s->sendq) s->sendq_tail = & (s->sendq);
+
+		next = s->closing ? 0 : s->sendq;
+		if (!next) s->flushing = 0;
+
+		cl_mutex_unlock (s->m);
+
+		request_free (q);
+
+		if (!next) break;
+		if (!ring_send (r, next) ) return;
+		q = next;
+	}
+
+	socket_unref (s);
+}
+
+static void ring_reap (struct io_ring*r)
+{
+	struct work*batch[IO_BATCH];
+	struct io_uring_cqe*cqe;
+	unsigned head, tail;
+	uintptr_t data;
+	int n = 0;
+
+	head = *r->cq_head;
+again:
+	tail = cl_atomic_read (r->cq_tail);
+	cl_barrier();
+
+	for (;head != tail;++head) {
+		cqe = r->cqes + (head & *r->cq_mask);
+		data = cqe->user_data & IO_PTR_MASK;
+
+		switch (cqe->user_data & IO_TAG) {
+		case IO_RECV:
+			ring_received (r, (struct io_socket*) data,
+			               cqe->res, cqe->flags, batch, &n);
+			break;
+		case IO_SEND:
+			ring_sent (r, (struct io_request*) data, cqe->res);
+			break;
+		}
+	}
+
+	ring_store (r->cq_head, head);
+	ring_store (& (r->br->tail), r->br_tail);
+
+	/*
+	 * completions that didn't fit wait in kernel until somebody asks for
+	 * them, and multishot receives stop meanwhile.
+	 */
+	if (cl_atomic_read (r->sq_flags) & IORING_SQ_CQ_OVERFLOW) {
+		while (syscall (__NR_io_uring_enter, r->fd, 0, 0,
+		                IORING_ENTER_GETEVENTS, 0, 0) < 0
+		        && errno == EINTR);
+		goto again;
+	}
+
+	if (n) cloudvpn_schedule_work_batch (batch, n);
+
+	/* receives and sends that had to go again */
+	cl_mutex_lock (r->sq_mutex);
+	ring_submit (r);
+	cl_mutex_unlock (r->sq_mutex);
+}
+
+static void ring_process_work (struct part*pt, struct work*w)
+{
+	struct io_ring*r = w->e.priv;
+
+	if (w->e.type != event_async) {
+		ring_reap (r);
+		return;
+	}
+
+	r->submit_scheduled = 0;
+	cl_barrier();
+
+	cl_mutex_lock (r->sq_mutex);
+	ring_submit (r);
+	cl_mutex_unlock (r->sq_mutex);
+}
+
+static void ring_finish (struct io_ring*r)
+{
+	struct io_uring_buf_reg reg;
+	int i;
+
+	memset (&reg, 0, sizeof (reg) );
+	syscall (__NR_io_uring_register, r->fd,
+	         IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+	if (r->cq_event) cloudvpn_delete_event (r->cq_event);
+
+	for (i = 0;i < RING_BUFS;++i) if (r->bufs[i]) cl_free (r->bufs[i]);
+	if (r->br) cl_free (r->br);
+
+	if (r->sqes) munmap (r->sqes, r->sqes_size);
+	if (r->mem) munmap (r->mem, r->mem_size);
+	if (r->sq_mutex) cl_mutex_destroy (r->sq_mutex);
+
+	close (r->fd);
+}
+
+static int ring_probe (struct io_ring*r)
+{
+	/*
+	 * multishot receive came in 6.0, older kernels fail it with EINVAL
+	 * (and buffer rings came in 5.19, so registering them isn't enough).
+	 * Try it on a socketpair with one byte and then the end of stream.
+	 * Nobody else uses the ring yet.
+	 */
+
+	struct io_uring_sqe*sqe;
+	struct io_uring_cqe*cqe;
+	unsigned head, tail;
+	int sp[2], ok = 0, more = 1;
+
+	if (socketpair (AF_UNIX, SOCK_STREAM, 0, sp) ) return 1;
+
+	if (write (sp[1], "", 1) != 1 || shutdown (sp[1], SHUT_WR) ) goto end;
+
+	sqe = ring_sqe (r);
+	if (!sqe) goto end;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sp[0];
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = IO_CANCEL;
+
+	ring_submit (r);
+
+	while (more) {
+		if (syscall (__NR_io_uring_enter, r->fd, 0, 1,
+		             IORING_ENTER_GETEVENTS, 0, 0) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		head = *r->cq_head;
+		tail = cl_atomic_read (r->cq_tail);
+		cl_barrier();
+
+		for (;head != tail;++head) {
+			cqe = r->cqes + (head & *r->cq_mask);
+
+			if (cqe->res > 0) ok = 1;
+			else if (cqe->res < 0) ok = 0;
+
+			if (cqe->flags & IORING_CQE_F_BUFFER)
+				ring_provide (r, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			if (! (cqe->flags & IORING_CQE_F_MORE) ) more = 0;
+		}
+
+		ring_store (r->cq_head, head);
+	}
+
+	ring_store (& (r->br->tail), r->br_tail);
+
+end:
+	close (sp[0]);
+	close (sp[1]);
+	return !ok;
+}
+
+static int ring_init (struct io_ring*r, int index)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	struct event*e;
+	char*m;
+	size_t cq_size;
+	void*br;
+	int i;
+
+	memset (r, 0, sizeof (struct io_ring) );
+	memset (&p, 0, sizeof (p) );
+
+	r->fd = syscall (__NR_io_uring_setup, RING_ENTRIES, &p);
+	if (r->fd < 0) return 1;
+
+	if (! (p.features & IORING_FEAT_SINGLE_MMAP)
+	        || ! (p.features & IORING_FEAT_NODROP) ) goto error;
+
+	/* rings */
+	r->mem_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (cq_size > r->mem_size) r->mem_size = cq_size;
+
+	m = mmap (0, r->mem_size, PROT_READ | PROT_WRITE,
+	          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (m == MAP_FAILED) goto error;
+	r->mem = m;
+
+	r->sq_head = (unsigned*) (m + p.sq_off.head);
+	r->sq_tail = (unsigned*) (m + p.sq_off.tail);
+	r->sq_mask = (unsigned*) (m + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*) (m + p.sq_off.array);
+	r->sq_flags = (unsigned*) (m + p.sq_off.flags);
+	r->sq_entries = p.sq_entries;
+	r->sq_local_tail = *r->sq_tail;
+
+	r->cq_head = (unsigned*) (m + p.cq_off.head);
+	r->cq_tail = (unsigned*) (m + p.cq_off.tail);
+	r->cq_mask = (unsigned*) (m + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*) (m + p.cq_off.cqes);
+
+	r->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+	r->sqes = mmap (0, r->sqes_size, PROT_READ | PROT_WRITE,
+	                MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = 0;
+		goto error;
+	}
+
+	/* provided buffers */
+	if (cl_aligned_alloc (&br, sysconf (_SC_PAGESIZE),
+	                      RING_BUFS * sizeof (struct io_uring_buf) ) )
+		goto error;
+	r->br = br;
+	memset (br, 0, RING_BUFS * sizeof (struct io_uring_buf) );
+
+	memset (&reg, 0, sizeof (reg) );
+	reg.ring_addr = (uintptr_t) br;
+	reg.ring_entries = RING_BUFS;
+	reg.bgid = 0;
+	if (syscall (__NR_io_uring_register, r->fd,
+	             IORING_REGISTER_PBUF_RING, &reg, 1) ) goto error;
+
+	for (i = 0;i < RING_BUFS;++i) {
+		r->bufs[i] = cl_malloc (IO_BUF_SIZE);
+		if (!r->bufs[i]) goto error;
+		ring_provide (r, i);
+	}
+	ring_store (& (r->br->tail), r->br_tail);
+
+	if (cl_mutex_init (&r->sq_mutex) ) {
+		r->sq_mutex = 0;
+		goto error;
+	}
+
+	if (ring_probe (r) ) goto error;
+
+	r->submit_work.type = work_event;
+	r->submit_work.priority = 0;
+	r->submit_work.is_static = 1;
+	r->submit_work.deadline = r->submit_work.enqueued = 0;
+	r->submit_work.e.type = event_async;
+	r->submit_work.e.owner = &ring_part;
+	r->submit_work.e.priv = r;
+	r->submit_work.ev = 0;
+
+	/* completions */
+	e = cloudvpn_new_event();
+	if (!e) goto error;
+	r->cq_event = e;
+
+	e->is_static = 1;
+	e->is_persistent = 1;
+	e->priority = 0;
+	e->affinity = index;
+	e->data.type = event_fd_readable;
+	e->data.fd = r->fd;
+	e->data.owner = &ring_part;
+	e->data.priv = r;
+
+	return 0;
+
+error:
+	ring_finish (r);
+	return 1;
+}
+
+static int uring_start()
+{
+	int i;
+
+	nrings = cloudvpn_event_loops();
+	rings = cl_malloc (nrings * sizeof (struct io_ring) );
+	if (!rings) return 1;
+
+	for (i = 0;i < nrings;++i)
+		if (ring_init (rings + i, i) ) {
+			while (i > 0) ring_finish (rings + --i);
+			cl_free (rings);
+			return 1;
+		}
+
+	for (i = 0;i < nrings;++i) cloudvpn_register_event (rings[i].cq_event);
+
+	return 0;
+}
+
+static void uring_stop()
+{
+	/* event loops don't run anymore */
+
+	int i;
+
+	for (i = 0;i < nrings;++i) ring_finish (rings + i);
+	cl_free (rings);
+	nrings = 0;
+}
+
+#else
+
+static int uring_start()
+{
+	return 1;
+}
+
+static void uring_stop() {}
+
+static void ring_process_work (struct part*pt, struct work*w) {}
+
+#endif
+
+/*
+ * libev backend
+ */
+
+static void socket_event_release (struct event*e)
+{
+	socket_unref (e->data.priv);
+}
+
+static struct event* socket_event (struct io_socket*s, int type)
+{
+	struct event*e = cloudvpn_new_event();
+
+	if (e) {
+		e->is_static = 1;
+		e->is_persistent = 1;
+		e->release = socket_event_release;
+		e->priority = s->priority;
+		e->affinity = owner_loop (s->owner);
+		e->data.type = type;
+		e->data.fd = s->fd;
+		e->data.owner = &socket_part;
+		e->data.priv = s;
+	}
+
+	return e;
+}
+
+static void socket_read (struct io_socket*s)
+{
+	struct work*batch[IO_BATCH];
+	struct packet*p;
+	char*buf;
+	ssize_t r;
+	int i, n = 0;
+
+	for (i = 0;i < IO_BATCH && !s->closing;++i) {
+		buf = cl_malloc (IO_BUF_SIZE);
+		if (!buf) break;
+
+		r = recv (s->fd, buf, IO_BUF_SIZE, MSG_DONTWAIT);
+
+		if (r <= 0) {
+			cl_free (buf);
+
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+			              || errno == EINTR) ) break;
+
+			/* end of stream or error, stop watching it */
+			if (cl_atomic_cas (&s->receiving, 1, 2) ) {
+				deliver (batch, &n, s, 0, r < 0 ? -errno : 0);
+				cloudvpn_unregister_event (s->rd);
+			}
+			break;
+		}
+
+		p = cloudvpn_packet_alloc();
+		if (!p) {
+			cl_free (buf);
+			break;
+		}
+
+		p->data = buf;
+		p->len = r;
+		deliver (batch, &n, s, p, r);
+	}
+
+	if (n) cloudvpn_schedule_work_batch (batch, n);
+}
+
+static void socket_wait_writable (struct io_socket*s)
+{
+	if (cl_atomic_cas (&s->wr_state, 0, 1) ) {
+		cl_atomic_add (&s->refs, 1);
+		cloudvpn_register_event (s->wr);
+	} else cloudvpn_event_enable (s->wr);
+}
+
+static void socket_flush (struct io_socket*s)
+{
+	/*
+	 * only the one who set s->flushing does this. Writable event is
+	 * switched under s->m, together with flushing and blocked, otherwise
+	 * we could disable it just after the next sender has enabled it.
+	 */
+
+	struct io_request*q;
+	ssize_t r;
+
+	for (;;) {
+		cl_mutex_lock (s->m);
+		q = s->sendq;
+		if (!q) {
+			s->flushing = 0;
+			if (s->wr_state == 1) cloudvpn_event_disable (s->wr);
+		}
+		cl_mutex_unlock (s->m);
+
+		if (!q) break;
+
+		r = send (s->fd, q->p->data + q->off, q->p->len - q->off,
+		          MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ) {
+			cl_mutex_lock (s->m);
+			s->blocked = 1;
+			socket_wait_writable (s);
+			cl_mutex_unlock (s->m);
+			return;
+		}
+
+		if (r < 0 && errno == EINTR) continue;
+
+		/* stream sockets may take just a part, failed sends are dropped */
+		if (r > 0 && (q->off += r) < q->p->len) continue;
+
+		cl_mutex_lock (s->m);
+		s->sendq = q->next;
+		if (!s->sendq) s->sendq_tail = & (s->sendq);
+		cl_mutex_unlock (s->m);
+
+		request_free (q);
+	}
+}
+
+static void socket_process_work (struct part*pt, struct work*w)
+{
+	struct io_socket*s = w->e.priv;
+	int blocked;
+
+	if (w->e.type == event_fd_readable) {
+		socket_read (s);
+		return;
+	}
+
+	/* writable, sending can go on */
+	cl_mutex_lock (s->m);
+	blocked = s->blocked;
+	s->blocked = 0;
+	if (!blocked) cloudvpn_event_disable (s->wr);
+	cl_mutex_unlock (s->m);
+
+	if (blocked) socket_flush (s);
+}
+
+/*
+ * frontend
+ */
+
+struct io_socket* cloudvpn_io_open (int fd, struct part*owner, int priority) {
+	struct io_socket*s;
+
+	s = cl_slab_alloc (socket_slab);
+	if (!s) return 0;
+
+	s->fd = fd;
+	s->owner = owner;
+	s->priority = priority;
+
+	s->refs = 1;
+	s->closing = 0;
+	s->receiving = 0;
+
+	s->r = 0;
+	s->rd = s->wr = 0;
+	s->wr_state = 0;
+	s->sendq = 0;
+	s->sendq_tail = & (s->sendq);
+	s->flushing = s->blocked = 0;
+
+	if (cl_mutex_init (&s->m) ) goto error;
+
+#ifdef HAVE_URING
+	if (backend == io_backend_uring) {
+		s->r = rings + owner_loop (owner) % nrings;
+		return s;
+	}
+#endif
+
+	s->rd = socket_event (s, event_fd_readable);
+	s->wr = socket_event (s, event_fd_writeable);
+	if (s->rd && s->wr) return s;
+
+	if (s->rd) cloudvpn_delete_event (s->rd);
+	if (s->wr) cloudvpn_delete_event (s->wr);
+	cl_mutex_destroy (s->m);
+error:
+	cl_slab_free (socket_slab, s);
+	return 0;
+}
+
+void cloudvpn_io_close (struct io_socket*s)
+{
+	s->closing = 1;
+	cl_barrier();
+
+#ifdef HAVE_URING
+	if (s->r) {
+		int cancel;
+
+		cl_mutex_lock (s->m);
+		cancel = cl_atomic_cas (&s->receiving, 1, 3);
+		cl_mutex_unlock (s->m);
+
+		if (cancel) ring_cancel (s->r, s);
+		socket_unref (s);
+		return;
+	}
+#endif
+
+	if (cl_atomic_cas (&s->receiving, 1, 2) )
+		cloudvpn_unregister_event (s->rd);
+
+	if (!cl_atomic_cas (&s->wr_state, 0, 2)
+	        && cl_atomic_cas (&s->wr_state, 1, 2) )
+		cloudvpn_unregister_event (s->wr);
+
+	socket_unref (s);
+}
+
+void cloudvpn_io_done (struct io_socket*s)
+{
+	socket_unref (s);
+}
+
+int cloudvpn_io_recv_start (struct io_socket*s)
+{
+	/* receiving can't be started again once it has ended */
+	if (s->closing || !cl_atomic_cas (&s->receiving, 0, 1) ) return 1;
+
+	cl_atomic_add (&s->refs, 1);
+
+#ifdef HAVE_URING
+	if (s->r) {
+		s->recv_tag = ( (uint64_t) (cl_atomic_add (&recv_gen, 1) & 0xffff)
+		                << IO_GEN_SHIFT) | (uintptr_t) s | IO_RECV;
+		if (ring_recv (s->r, s) ) {
+			s->receiving = 2;
+			socket_unref (s);
+			return 1;
+		}
+		ring_kick (s->r);
+		return 0;
+	}
+#endif
+
+	return cloudvpn_register_event (s->rd);
+}
+
+int cloudvpn_io_send (struct io_socket*s, struct packet*p)
+{
+	struct io_request*q;
+	int flush;
+
+	if (s->closing || ! (q = request_new (s, p) ) ) {
+		cloudvpn_packet_free (p);
+		return 1;
+	}
+
+	cl_mutex_lock (s->m);
+
+	*s->sendq_tail = q;
+	s->sendq_tail = & (q->next);
+
+	flush = !s->flushing;
+	s->flushing = 1;
+
+	cl_mutex_unlock (s->m);
+
+	if (!flush) return 0;
+
+#ifdef HAVE_URING
+	if (s->r) {
+		/* the send in ring holds a reference */
+		cl_atomic_add (&s->refs, 1);
+		if (ring_send (s->r, q) ) {
+			/* dropped like a failed send, the queue goes on */
+			ring_sent (s->r, q, -EBUSY);
+			ring_kick (s->r);
+			return 1;
+		}
+		ring_kick (s->r);
+		return 0;
+	}
+#endif
+
+	socket_flush (s);
+
+	return 0;
+}
+
+/*
+ * initialization
+ */
+
+int cloudvpn_io_set_backend (int b)
+{
+	if (b == io_backend_uring && backend != io_backend_uring
+	        && !uring_start() ) backend = io_backend_uring;
+
+	return backend;
+}
+
+int cloudvpn_io_backend()
+{
+	return backend;
+}
+
+int cloudvpn_io_init()
+{
+	backend = io_backend_libev;
+
+	socket_slab = cl_slab_new (struct io_socket);
+	if (!socket_slab) return 1;
+
+	request_slab = cl_slab_new (struct io_request);
+	if (!request_slab) {
+		cl_slab_destroy (socket_slab);
+		return 1;
+	}
+
+	return 0;
+}
+
+void cloudvpn_io_finish()
+{
+	if (backend == io_backend_uring) uring_stop();
+	backend = io_backend_libev;
+
+	cl_slab_destroy (request_slab);
+	cl_slab_destroy (socket_slab);
+}
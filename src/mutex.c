@@ -20,6 +20,7 @@
 #include "alloc.h"
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
 
 int cl_mutex_init (cl_mutex* mp)
 {
@@ -74,6 +75,24 @@ int cl_cond_wait (cl_cond c, cl_mutex m)
 	return pthread_cond_wait ( (pthread_cond_t*) c, (pthread_mutex_t*) m);
 }
 
+int cl_cond_timedwait (cl_cond c, cl_mutex m, uint64_t usec)
+{
+	/* waits at most usec microseconds, returns nonzero on timeout */
+
+	struct timespec ts;
+
+	clock_gettime (CLOCK_REALTIME, &ts);
+	ts.tv_sec += usec / 1000000;
+	ts.tv_nsec += 1000 * (usec % 1000000);
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_nsec -= 1000000000;
+		++ts.tv_sec;
+	}
+
+	return pthread_cond_timedwait ( (pthread_cond_t*) c,
+	                                (pthread_mutex_t*) m, &ts);
+}
+
 int cl_cond_signal (cl_cond c)
 {
 	return pthread_cond_signal ( (pthread_cond_t*) c);
@@ -13,14 +13,18 @@
 #include "packet.h"
 #include "alloc.h"
 
+static struct cl_slab* packet_slab;
+
 struct packet* cloudvpn_packet_alloc() {
-	return cl_calloc (1, sizeof (struct packet) ); /* note the zeroes! */
+	struct packet*p = cl_slab_alloc (packet_slab);
+	if (p) memset (p, 0, sizeof (struct packet) ); /* note the zeroes! */
+	return p;
 }
 
 void cloudvpn_packet_free (struct packet* p)
 {
 	if (p->data) cl_free (p->data);
-	cl_free (p);
+	cl_slab_free (packet_slab, p);
 }
 
 int cloudvpn_alloc_data (struct packet* p)
@@ -34,3 +38,14 @@ int cloudvpn_alloc_data (struct packet* p)
 		return 1;
 }
 
+int cloudvpn_packet_init()
+{
+	packet_slab = cl_slab_new (struct packet);
+	return !packet_slab;
+}
+
+void cloudvpn_packet_finish()
+{
+	cl_slab_destroy (packet_slab);
+}
+
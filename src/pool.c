@@ -134,11 +134,17 @@ struct part* cloudvpn_part_init (struct plugin* plug, const char*name) {
 		for (i = i - 1;i >= 0;--i) p->name[i] = name[i];
 	} else p->name = 0;
 
+	p->mbox = cloudvpn_new_mailbox (p);
+	if (!p->mbox) goto mbox_error;
+
 	/* call the constructor */
 	if (p->p->init) p->p->init (p);
 
 	return p;
 
+mbox_error:
+	if (p->name) cl_free (p->name);
+
 sem_error:
 	cl_sem_destroy (p->refcount);
 
@@ -171,6 +177,7 @@ static void cloudvpn_part_destroy (struct part*p)
 
 	cl_sem_get (p->p->refcount);
 
+	cloudvpn_delete_mailbox (p->mbox);
 	cl_sem_destroy (p->refcount);
 	cl_free (p);
 }
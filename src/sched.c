@@ -12,90 +12,2129 @@
 
 #include "sched.h"
 #include "event.h"
+#include "io.h"
 #include "alloc.h"
 #include "mutex.h"
+#include "atomic.h"
+#include "clock.h"
+#include "thread.h"
+#include "topology.h"
+
+#include <stdlib.h>
+
+/*
+ * Run queue is an array of FIFOs, one for each priority, and a bitmap of the
+ * nonempty ones. Insertion and removal therefore don't depend on how long the
+ * queue is, which is important when we are overloaded.
+ *
+ * Works are linked through their own next pointers, so queueing doesn't need
+ * to allocate anything.
+ *
+ * Works with a deadline are kept in a heap (earliest deadline first) and go
+ * before all the priorities.
+ */
+
+#define PRIORITIES (LOWEST_PRIORITY+1)
+#define MAP_BITS 64
+#define MAP_WORDS (PRIORITIES/MAP_BITS)
+#define EMPTY_TOP PRIORITIES
+#define DEADLINE_TOP (-1)
+
+struct runqueue {
+	cl_mutex m;
+	struct work* head[PRIORITIES];
+	struct work* tail[PRIORITIES];
+	uint64_t map[MAP_WORDS]; /* bit is set for nonempty priority */
+
+	struct work** edf; /* heap of works with deadlines */
+	int edf_len, edf_size;
+
+	int len;
+	int max_len; /* high-water mark */
+	int plen[PRIORITIES]; /* lengths of the FIFOs, for admission */
+	int top; /* most urgent nonempty priority, DEADLINE_TOP or EMPTY_TOP */
+};
+
+/*
+ * Every thread that runs the scheduler is a worker and has its own run queue.
+ * Work scheduled from a worker goes to its own queue, so that workers don't
+ * fight over a single lock. Work from other threads (that are not workers)
+ * goes to the shared queue. Worker takes the more urgent work from its own
+ * and the shared queue, and if both are empty, it steals the most urgent work
+ * from other workers. If there's nothing to steal, it parks.
+ *
+ * Workers are grouped by the numa node they run on. Thieves look at the
+ * workers of their own node first, and work scheduled on one node wakes up
+ * the parked workers of that node first, so works and packets mostly stay
+ * in the memory of the node.
+ */
+
+/*
+ * Timers (works scheduled for later) are kept in heaps ordered by their
+ * time. Every worker has a heap for the timers it sets itself and checks it
+ * between the works. Timers set by other threads go to the shared heap that
+ * all workers check. Parked workers, and the worker waiting for events,
+ * sleep only until the nearest timer.
+ */
+
+struct timerheap {
+	cl_mutex m;
+	struct work** h;
+	int len, size;
+	uint64_t next; /* time of the nearest timer, 0 if there's none */
+};
+
+#define TIMER_BATCH 16 /* expired timers scheduled at once */
+
+/*
+ * Telemetry histograms of a worker. These are big (so they're allocated only
+ * for the workers) and written only by the owner, so recording takes just
+ * two clock reads and a few increments.
+ */
+
+struct telemetry {
+	struct sched_telemetry prio[PRIORITIES];
+	struct sched_telemetry type[WORK_TYPES];
+};
+
+struct worker {
+	struct runqueue rq;
+	struct runqueue flow_rq; /* packets steered here by flow */
+
+	cl_mutex park_mutex;
+	cl_cond park_cond;
+	int parked;
+	int polling; /* blocked waiting for events */
+	int poll_loop; /* in this event loop */
+	int batch_left; /* works waiting in the private batch */
+
+	int cur_prio; /* of the work being processed, for yielding */
+	uint64_t work_start;
+
+	int active; /* slot is used by a running thread */
+	int node; /* numa node the worker started on */
+	int* keep_running;
+
+	struct sched_worker_stats stats; /* written only by the owner */
+	struct telemetry* tm; /* same */
+
+	struct timerheap timers;
+};
+
+static struct runqueue shared_rq;
+static struct timerheap shared_timers;
+
+static struct worker workers[MAX_WORKERS];
+static int nworkers; /* number of used slots */
+static int nparked; /* number of parked workers */
+static int npolling; /* number of workers blocked in event loops */
+static uint64_t wakeups_sent, wakeups_saved;
+static cl_mutex workers_mutex;
+
+static __thread struct worker* this_worker;
+
+/*
+ * Flow steering. If enabled, packet works are sent to a worker chosen by
+ * hash of packet addresses, so one flow stays on one cpu (keeping the caches
+ * warm and the packets in order). Others steal those only if the worker has
+ * too much of them, and packets taken by a thief run alongside the ones left
+ * to the owner, so stolen flows can get reordered. Threshold decides what
+ * matters more, order or spreading the load.
+ */
+
+static int flow_steering = 0;
+static int flow_steal_threshold = 0;
+
+/*
+ * Mailboxes. If enabled, works for a part are queued in the part's mailbox,
+ * and the mailbox itself gets scheduled as one work. Only one worker can
+ * drain the mailbox at a time, so part never runs on two threads at once and
+ * plugins don't need locking. This takes precedence over flow steering.
+ * Queued mailbox can't change its priority, so if a more urgent work comes
+ * meanwhile, a second work of the mailbox gets queued with that urgency, and
+ * whichever of them comes first does the draining.
+ *
+ * Mailboxes also share the cpu fairly among the parts (deficit round robin):
+ * every time the mailbox gets scheduled, the part can run for weight times
+ * DRR_QUANTUM, and then it goes to the end of the queue. Part's cpu time is
+ * accounted in the mailbox, in both modes.
+ */
+
+struct mailbox {
+	struct part*pt;
+
+	cl_mutex m;
+	struct work *head, *tail;
+	int len; /* works posted and not yet dispatched */
+	int scheduled; /* w is queued */
+	int boosted; /* urgent is queued */
+	int draining; /* someone processes the works */
+	int dead; /* deleted, freed when none of the above */
+
+	struct work w; /* static work_mailbox */
+	struct work urgent; /* same, for works more urgent than w */
+
+	int weight;
+	int64_t deficit; /* nanoseconds, touched only by the draining thread */
+
+	uint64_t cpu_time, works;
+};
+
+static int use_mailboxes = 0;
+
+#define MAILBOX_BATCH 16
+#define DRR_QUANTUM 100000 /* nanoseconds */
+
+/*
+ * Idle policy. Parking and waking up costs a context switch and a futex
+ * call, so idle worker may first spin for a while (checking for work), then
+ * spin with yielding the cpu, and park only after that.
+ */
+
+static int idle_spin_usec = 0;
+static int idle_yield_usec = 0;
+
+#define SPIN_CHECK 64 /* cpu_relax()es between looking for work */
+
+/*
+ * Event poll is the least urgent work, so under load it can wait for very
+ * long, and no fds are read meanwhile. If that takes more than
+ * poll_latency_usec, some worker does a nonblocking poll between works.
+ *
+ * With several event loops, every loop has its poll work, which is steered
+ * to the worker of the same number, so each worker watches its own fds.
+ */
+
+static int poll_latency_usec = 0;
+static uint64_t last_poll[MAX_EVENT_LOOPS];
+
+/*
+ * Direct dispatch. A packet handed off to the next part is processed right
+ * away on the same thread (the cache is still warm, and nothing is locked),
+ * as long as the handoffs don't nest deeper than direct_depth and the whole
+ * chain doesn't run longer than direct_budget. Then it goes to the queue as
+ * usual, so one stream of packets can't hog the worker.
+ */
+
+static int direct_depth = 0; /* 0 = off */
+static uint64_t direct_budget = 0; /* nanoseconds */
+
+static __thread int direct_level;
+static __thread uint64_t direct_start;
+
+/*
+ * Long jobs of parts are split into continuations. The part asks
+ * cloudvpn_should_yield between the steps, which compares the current work
+ * with the most urgent one waiting for this worker, and with the slice.
+ */
+
+static uint64_t yield_slice = 0; /* nanoseconds */
+
+static int use_telemetry = 0;
 
 /*
- * simple list that contains tasks that need to be done.
+ * Ring backend. Deployments that don't need priorities can replace the
+ * locked queues by one bounded lock-free ring (multi-producer and
+ * multi-consumer, as done by D. Vyukov). Every slot has a sequence number
+ * that tells whether it's free for the producer at that position, or full
+ * for the consumer at that position, so both sides only need one CAS on
+ * their position. Slots take whole cache lines, so neighbor producers and
+ * consumers don't bounce the lines among them.
  *
- * I can think of modifying it to something better
+ * Works with deadline, and works that don't fit into a full ring, go to the
+ * locked queues as usual.
+ */
+
+#define CACHE_LINE 64
+
+struct ring_slot {
+	uint64_t seq;
+	struct work*w;
+} __attribute__ ( (aligned (CACHE_LINE) ) );
+
+struct ring {
+	struct ring_slot*slot;
+	uint64_t mask;
+
+	uint64_t enqueue_pos __attribute__ ( (aligned (CACHE_LINE) ) );
+	uint64_t dequeue_pos __attribute__ ( (aligned (CACHE_LINE) ) );
+};
+
+static struct ring ring;
+static int use_ring = 0;
+
+/*
+ * Queue limits. Capacity is checked against the FIFO of the work's priority
+ * in the run queue (or mailbox) the work goes to, so every queue is bounded
+ * separately. Zero capacity means no limit.
+ */
+
+static int capacity[PRIORITIES];
+static int drop_policy[PRIORITIES];
+static uint64_t drops[PRIORITIES];
+
+static __thread unsigned int red_seed;
+
+/* static works for event waiting that get never deleted */
+static struct work poll_works[MAX_EVENT_LOOPS];
+
+static struct cl_slab* work_slab;
+
+static void drop_work (struct work*w)
+{
+	/* also frees what the work carries, for works that won't be done */
+	cl_atomic_add (drops + w->priority, 1);
+
+	if (w->type == work_packet && w->p) cloudvpn_packet_free (w->p);
+	if (w->type == work_io && w->io.p) cloudvpn_packet_free (w->io.p);
+	cloudvpn_delete_work (w);
+}
+
+static void mailbox_forget (struct mailbox*, struct work*);
+
+/*
+ * run queue operations
+ */
+
+static int rq_init (struct runqueue*rq)
+{
+	int i;
+
+	for (i = 0;i < PRIORITIES;++i) {
+		rq->head[i] = rq->tail[i] = 0;
+		rq->plen[i] = 0;
+	}
+	for (i = 0;i < MAP_WORDS;++i) rq->map[i] = 0;
+
+	rq->edf = 0;
+	rq->edf_len = rq->edf_size = 0;
+
+	rq->len = rq->max_len = 0;
+	rq->top = EMPTY_TOP;
+	return cl_mutex_init (&rq->m);
+}
+
+static int rq_destroy (struct runqueue*rq)
+{
+	int i;
+	struct work*p;
+
+	for (i = 0;i < PRIORITIES;++i) while (rq->head[i]) {
+			p = rq->head[i];
+			rq->head[i] = p->next;
+			if (! (p->is_static) ) drop_work (p);
+			else if (p->type == work_mailbox) mailbox_forget (p->mb, p);
+		}
+
+	for (i = 0;i < rq->edf_len;++i)
+		if (! (rq->edf[i]->is_static) ) drop_work (rq->edf[i]);
+		else if (rq->edf[i]->type == work_mailbox)
+			mailbox_forget (rq->edf[i]->mb, rq->edf[i]);
+
+	if (rq->edf) cl_free (rq->edf);
+
+	return cl_mutex_destroy (rq->m);
+}
+
+static int edf_push (struct runqueue*rq, struct work*w)
+{
+	int i, parent;
+	struct work**t;
+
+	if (rq->edf_len == rq->edf_size) {
+		i = rq->edf_size ? 2 * rq->edf_size : 16;
+		t = cl_realloc (rq->edf, i * sizeof (struct work*) );
+		if (!t) return 1;
+		rq->edf = t;
+		rq->edf_size = i;
+	}
+
+	for (i = rq->edf_len++;i > 0;i = parent) {
+		parent = (i - 1) / 2;
+		if (rq->edf[parent]->deadline <= w->deadline) break;
+		rq->edf[i] = rq->edf[parent];
+	}
+
+	rq->edf[i] = w;
+
+	return 0;
+}
+
+static struct work* edf_pop (struct runqueue*rq)
+{
+	int i, child;
+	struct work *r, *last;
+
+	r = rq->edf[0];
+	last = rq->edf[--rq->edf_len];
+
+	for (i = 0; (child = 2 * i + 1) < rq->edf_len;i = child) {
+		if (child + 1 < rq->edf_len && rq->edf[child+1]->deadline
+		        < rq->edf[child]->deadline) ++child;
+		if (last->deadline <= rq->edf[child]->deadline) break;
+		rq->edf[i] = rq->edf[child];
+	}
+
+	rq->edf[i] = last;
+
+	return r;
+}
+
+static int rq_find_top (struct runqueue*rq)
+{
+	int i;
+
+	if (rq->edf_len) return DEADLINE_TOP;
+
+	for (i = 0;i < MAP_WORDS;++i)
+		if (rq->map[i])
+			return i * MAP_BITS + __builtin_ctzll (rq->map[i]);
+
+	return EMPTY_TOP;
+}
+
+/* these two expect the queue to be locked */
+
+static void rq_insert (struct runqueue*rq, struct work*nw)
+{
+	int prio = nw->priority;
+
+	nw->next = 0;
+
+	/* if the heap can't grow, just treat it as usual work */
+	if (nw->deadline && !edf_push (rq, nw) ) {
+		rq->top = DEADLINE_TOP;
+		return;
+	}
+
+	if (rq->head[prio]) rq->tail[prio]->next = nw;
+	else {
+		rq->head[prio] = nw;
+		rq->map[prio/MAP_BITS] |= 1ULL << (prio % MAP_BITS);
+		if (prio < rq->top) rq->top = prio;
+	}
+	rq->tail[prio] = nw;
+	++rq->plen[prio];
+}
+
+static struct work* rq_remove_prio (struct runqueue*rq, int prio)
+{
+	struct work*p;
+
+	p = rq->head[prio];
+	rq->head[prio] = p->next;
+	--rq->plen[prio];
+	if (!p->next) {
+		rq->map[prio/MAP_BITS] &= ~ (1ULL << (prio % MAP_BITS) );
+		if (prio == rq->top) rq->top = rq_find_top (rq);
+	}
+
+	return p;
+}
+
+static struct work* rq_remove (struct runqueue*rq)
+{
+	int prio;
+	struct work*p;
+
+	prio = rq->top;
+	if (prio == EMPTY_TOP) return 0;
+
+	if (prio == DEADLINE_TOP) {
+		p = edf_pop (rq);
+		if (!rq->edf_len) rq->top = rq_find_top (rq);
+		return p;
+	}
+
+	return rq_remove_prio (rq, prio);
+}
+
+/*
+ * timer heap operations
+ */
+
+static int th_init (struct timerheap*t)
+{
+	t->h = 0;
+	t->len = t->size = 0;
+	t->next = 0;
+	return cl_mutex_init (&t->m);
+}
+
+static int th_destroy (struct timerheap*t)
+{
+	int i;
+
+	for (i = 0;i < t->len;++i)
+		if (! (t->h[i]->is_static) ) drop_work (t->h[i]);
+
+	if (t->h) cl_free (t->h);
+
+	return cl_mutex_destroy (t->m);
+}
+
+/* these two expect the heap to be locked */
+
+static int th_insert (struct timerheap*t, struct work*w)
+{
+	int i, parent;
+	struct work**n;
+
+	if (t->len == t->size) {
+		i = t->size ? 2 * t->size : 16;
+		n = cl_realloc (t->h, i * sizeof (struct work*) );
+		if (!n) return 1;
+		t->h = n;
+		t->size = i;
+	}
+
+	for (i = t->len++;i > 0;i = parent) {
+		parent = (i - 1) / 2;
+		if (t->h[parent]->at <= w->at) break;
+		t->h[i] = t->h[parent];
+	}
+
+	t->h[i] = w;
+	t->next = t->h[0]->at;
+
+	return 0;
+}
+
+static struct work* th_remove (struct timerheap*t)
+{
+	int i, child;
+	struct work *r, *last;
+
+	if (!t->len) return 0;
+
+	r = t->h[0];
+	last = t->h[--t->len];
+
+	for (i = 0; (child = 2 * i + 1) < t->len;i = child) {
+		if (child + 1 < t->len && t->h[child+1]->at < t->h[child]->at)
+			++child;
+		if (last->at <= t->h[child]->at) break;
+		t->h[i] = t->h[child];
+	}
+
+	t->h[i] = last;
+	t->next = t->len ? t->h[0]->at : 0;
+
+	return r;
+}
+
+/*
+ * ring operations
+ */
+
+static int ring_push (struct work*w)
+{
+	/* returns nonzero if the ring is full */
+
+	uint64_t pos;
+	int64_t dif;
+	struct ring_slot*s;
+
+	pos = cl_atomic_read (&ring.enqueue_pos);
+
+	for (;;) {
+		s = ring.slot + (pos & ring.mask);
+		dif = (int64_t) (cl_atomic_read (&s->seq) - pos);
+
+		if (!dif) {
+			if (cl_atomic_cas (&ring.enqueue_pos, pos, pos + 1) ) break;
+			pos = cl_atomic_read (&ring.enqueue_pos);
+		} else if (dif < 0) return 1;
+		else pos = cl_atomic_read (&ring.enqueue_pos);
+	}
+
+	s->w = w;
+
+	/* publish the work only after it's written */
+	cl_barrier();
+	s->seq = pos + 1;
+
+	return 0;
+}
+
+static struct work* ring_pop()
+{
+	uint64_t pos;
+	int64_t dif;
+	struct ring_slot*s;
+	struct work*w;
+
+	pos = cl_atomic_read (&ring.dequeue_pos);
+
+	for (;;) {
+		s = ring.slot + (pos & ring.mask);
+		dif = (int64_t) (cl_atomic_read (&s->seq) - (pos + 1) );
+
+		if (!dif) {
+			if (cl_atomic_cas (&ring.dequeue_pos, pos, pos + 1) ) break;
+			pos = cl_atomic_read (&ring.dequeue_pos);
+		} else if (dif < 0) return 0;
+		else pos = cl_atomic_read (&ring.dequeue_pos);
+	}
+
+	w = s->w;
+
+	/* slot is free for the producer one lap later */
+	cl_barrier();
+	s->seq = pos + ring.mask + 1;
+
+	return w;
+}
+
+static int ring_len()
+{
+	int64_t n;
+
+	if (!use_ring) return 0;
+
+	n = (int64_t) (cl_atomic_read (&ring.enqueue_pos)
+	               - cl_atomic_read (&ring.dequeue_pos) );
+
+	return n > 0 ? n : 0;
+}
+
+static int ring_pop_batch (struct work**out, int max)
+{
+	int n = 0;
+
+	if (!ring_len() ) return 0;
+
+	while (n < max && (out[n] = ring_pop() ) ) ++n;
+
+	return n;
+}
+
+/*
+ * admission control
  */
 
-struct work_queue {
-	struct work_queue*next;
-	struct work*w;
-};
+static int admit (struct work*w, int len)
+{
+	/* decide about work coming to a FIFO of length len */
+
+	int cap, half;
+
+	cap = capacity[w->priority];
+	if (!cap || w->deadline || w->is_static
+	        || w->type == work_continuation) return schedule_ok;
+
+	half = cap / 2;
+	if (len < half) return schedule_ok;
+
+	if (len >= cap) return drop_policy[w->priority] == drop_head ?
+		                       schedule_congested : schedule_dropped;
+
+	/* red drops with probability growing linearly from half to cap */
+	if (drop_policy[w->priority] == drop_red
+	        && rand_r (&red_seed) % (cap - half) < len - half)
+		return schedule_dropped;
+
+	return schedule_congested;
+}
+
+static int evictable (struct work*w, int prio)
+{
+	/* what drop_head may drop to make space for new work of prio */
+	return w->priority == prio && !w->is_static && !w->deadline
+	       && w->type != work_continuation;
+}
+
+static struct work* rq_evict (struct runqueue*rq, int prio)
+{
+	/* oldest work of the FIFO that drop_head may drop, or 0 */
+
+	struct work *p, *prev = 0;
+
+	for (p = rq->head[prio];p;prev = p, p = p->next)
+		if (evictable (p, prio) ) break;
+
+	if (!p) return 0;
+	if (!prev) return rq_remove_prio (rq, prio);
+
+	prev->next = p->next;
+	if (rq->tail[prio] == p) rq->tail[prio] = prev;
+	--rq->plen[prio];
+
+	return p;
+}
+
+static int rq_admit (struct runqueue*rq, struct work*w, struct work**dropped)
+{
+	/*
+	 * expects the queue to be locked. If the oldest work should be dropped
+	 * to make space, it's removed and returned in dropped. If none of the
+	 * queued works may go, the new one is dropped instead.
+	 */
+
+	int r, prio = w->priority;
+
+	r = admit (w, rq->plen[prio]);
+
+	if (r == schedule_congested && rq->plen[prio] >= capacity[prio]) {
+		if (! (*dropped = rq_evict (rq, prio) ) ) return schedule_dropped;
+		cl_atomic_sub (&rq->len, 1);
+	}
+
+	return r;
+}
+
+static int rq_push_if (struct runqueue*rq, struct work*nw, int*cond)
+{
+	/*
+	 * if cond is given, the work goes in only if it's nonzero under the
+	 * lock; otherwise schedule_error is returned and nothing is done.
+	 */
+
+	int r;
+	struct work*dropped = 0;
+
+	if (use_telemetry) nw->enqueued = cl_clock_nsec();
+
+	cl_mutex_lock (rq->m);
+
+	if (cond && !cl_atomic_read (cond) ) {
+		cl_mutex_unlock (rq->m);
+		return schedule_error;
+	}
+
+	r = rq_admit (rq, nw, &dropped);
+	if (r != schedule_dropped) {
+		rq_insert (rq, nw);
+		if (cl_atomic_add (&rq->len, 1) > rq->max_len) rq->max_len = rq->len;
+	}
+
+	cl_mutex_unlock (rq->m);
+
+	/* free them outside the lock */
+	if (dropped) drop_work (dropped);
+	if (r == schedule_dropped) drop_work (nw);
+
+	return r;
+}
+
+static int rq_push (struct runqueue*rq, struct work*nw)
+{
+	return rq_push_if (rq, nw, 0);
+}
+
+static int rq_push_list (struct runqueue*rq, struct work*list, int*pushed)
+{
+	/*
+	 * push a whole list (linked by next) at once, return the worst
+	 * admission result and the number of works that were queued
+	 */
+
+	int n = 0, r, worst = schedule_ok;
+	struct work *next, *dropped, *drop_list = 0;
+	uint64_t now = 0;
+
+	if (use_telemetry) now = cl_clock_nsec();
+
+	cl_mutex_lock (rq->m);
+
+	for (;list;list = next) {
+		next = list->next;
+		list->enqueued = now;
+		dropped = 0;
+
+		r = rq_admit (rq, list, &dropped);
+		if (r > worst) worst = r;
+
+		if (dropped) {
+			dropped->next = drop_list;
+			drop_list = dropped;
+		}
+
+		if (r == schedule_dropped) {
+			list->next = drop_list;
+			drop_list = list;
+		} else {
+			rq_insert (rq, list);
+			++n;
+		}
+	}
+
+	if (cl_atomic_add (&rq->len, n) > rq->max_len) rq->max_len = rq->len;
+
+	cl_mutex_unlock (rq->m);
+
+	for (;drop_list;drop_list = next) {
+		next = drop_list->next;
+		drop_work (drop_list);
+	}
+
+	*pushed = n;
+	return worst;
+}
+
+static int rq_pop_batch (struct runqueue*rq, struct work**out, int max)
+{
+	/* take max most urgent works at once, return how many we've got */
+
+	int n = 0;
+
+	/* don't touch the lock of empty queues */
+	if (!cl_atomic_read (&rq->len) ) return 0;
+
+	cl_mutex_lock (rq->m);
+
+	while (n < max && (out[n] = rq_remove (rq) ) ) ++n;
+
+	if (n) cl_atomic_sub (&rq->len, n);
+
+	cl_mutex_unlock (rq->m);
+
+	return n;
+}
+
+static struct work* rq_pop (struct runqueue*rq)
+{
+	struct work*p;
+
+	if (rq_pop_batch (rq, &p, 1) ) return p;
+	return 0;
+}
+
+/*
+ * worker management
+ */
+
+static struct worker* worker_register()
+{
+	int i;
+	struct worker*w = 0;
+
+	cl_mutex_lock (workers_mutex);
+
+	/* reuse slot of some finished thread */
+	for (i = 0;i < nworkers;++i) if (!workers[i].active) {
+			w = workers + i;
+			break;
+		}
+
+	if (!w) {
+		if (nworkers >= MAX_WORKERS) goto error;
+
+		w = workers + nworkers;
+
+		if (rq_init (&w->rq) ) goto error;
+		if (rq_init (&w->flow_rq) ) goto error_flow;
+		if (cl_mutex_init (&w->park_mutex) ) goto error_mutex;
+		if (cl_cond_init (&w->park_cond) ) goto error_cond;
+		if (! (w->tm = cl_calloc (1, sizeof (struct telemetry) ) ) )
+			goto error_tm;
+		if (th_init (&w->timers) ) goto error_timers;
+
+		w->parked = 0;
+		w->polling = 0;
+		memset (&w->stats, 0, sizeof (w->stats) );
+
+		/* publish the slot only after it's ready for stealing */
+		cl_barrier();
+		++nworkers;
+	}
+
+	w->node = cl_current_node();
+	w->active = 1;
+
+	cl_mutex_unlock (workers_mutex);
+
+	return w;
+
+error_timers:
+	cl_free (w->tm);
+error_tm:
+	cl_cond_destroy (w->park_cond);
+error_cond:
+	cl_mutex_destroy (w->park_mutex);
+error_mutex:
+	rq_destroy (&w->flow_rq);
+error_flow:
+	rq_destroy (&w->rq);
+error:
+	cl_mutex_unlock (workers_mutex);
+	return 0;
+}
+
+static void worker_unregister (struct worker*w)
+{
+	struct work*p;
+
+	/*
+	 * stop others from steering work to us first. They check it under the
+	 * lock of our flow queue (see steer_work), so once we've had the lock,
+	 * nothing comes after the queues are emptied.
+	 */
+	cl_mutex_lock (workers_mutex);
+	cl_mutex_lock (w->flow_rq.m);
+	w->active = 0;
+	cl_mutex_unlock (w->flow_rq.m);
+	cl_mutex_unlock (workers_mutex);
+
+	/*
+	 * hand the work that's left over to the others. It was already
+	 * admitted, so it goes in regardless of the limits.
+	 */
+	cl_mutex_lock (shared_rq.m);
+	while ( (p = rq_pop (&w->rq) ) || (p = rq_pop (&w->flow_rq) ) ) {
+		rq_insert (&shared_rq, p);
+		if (cl_atomic_add (&shared_rq.len, 1) > shared_rq.max_len)
+			shared_rq.max_len = shared_rq.len;
+	}
+	cl_mutex_unlock (shared_rq.m);
+
+	/* and the timers too */
+	cl_mutex_lock (w->timers.m);
+	cl_mutex_lock (shared_timers.m);
+
+	while ( (p = th_remove (&w->timers) ) )
+		if (th_insert (&shared_timers, p) )
+			/* it's late anyway */
+			rq_push (&shared_rq, p);
+
+	cl_mutex_unlock (shared_timers.m);
+	cl_mutex_unlock (w->timers.m);
+}
+
+static int wake_worker (struct worker*w)
+{
+	int r = 0;
+
+	cl_mutex_lock (w->park_mutex);
+
+	if (w->parked) {
+		w->parked = 0;
+		cl_atomic_sub (&nparked, 1);
+		cl_cond_signal (w->park_cond);
+		r = 1;
+	}
+
+	cl_mutex_unlock (w->park_mutex);
+
+	return r;
+}
+
+static int unattended_backlog()
+{
+	/*
+	 * count how many works are waiting, minus how many of them will soon
+	 * be taken by the workers that are running (not parked or blocked in
+	 * the event loop).
+	 */
+
+	int i, n, r;
+	struct worker*w;
+
+	r = cl_atomic_read (&shared_rq.len) + ring_len();
+
+	n = cl_atomic_read (&nworkers);
+	for (i = 0;i < n;++i) {
+		w = workers + i;
+		r += cl_atomic_read (&w->rq.len) + cl_atomic_read (&w->flow_rq.len);
+		if (cl_atomic_read (&w->active)
+		        && !cl_atomic_read (&w->parked)
+		        && !cl_atomic_read (&w->polling) ) --r;
+	}
+
+	return r;
+}
+
+static void wake_some_workers (int count)
+{
+	int i, n, woken, node, pass;
+
+	/*
+	 * Note that waking up one worker for every scheduled work is enough,
+	 * as one work can be done only by one thread. Also, if the running
+	 * workers can handle all the work, waking others is a waste of time.
+	 */
+
+	if (!cl_atomic_get (&nparked) && !cl_atomic_get (&npolling) ) return;
+
+	n = unattended_backlog();
+	if (n < count) {
+		cl_atomic_add (&wakeups_saved, count - (n > 0 ? n : 0) );
+		count = n;
+	}
+
+	if (count <= 0) return;
+
+	n = cl_atomic_read (&nworkers);
+	node = this_worker ? this_worker->node : cl_current_node();
+
+	/* first pass wakes the ones on our node, second the rest */
+	for (pass = 0, woken = 0;pass < 2;++pass)
+		for (i = 0;woken < count && i < n;++i)
+			if ( (workers[i].node == node) != pass
+			        && cl_atomic_read (&workers[i].parked)
+			        && wake_worker (workers + i) ) ++woken;
+
+	/* nobody parked, so get the work to whoever sits in an event loop */
+	for (pass = 0;pass < 2;++pass)
+		for (i = 0;woken < count && i < n;++i)
+			if ( (workers[i].node == node) != pass
+			        && cl_atomic_read (&workers[i].polling) ) {
+				cloudvpn_event_wakeup
+				(cl_atomic_read (&workers[i].poll_loop) );
+				++woken;
+			}
+
+	cl_atomic_add (&wakeups_sent, woken);
+}
+
+static int flow_stealable (struct worker*w)
+{
+	/* how many steered works can be taken from this worker */
+	int n = cl_atomic_read (&w->flow_rq.len) - flow_steal_threshold;
+	return n > 0 ? n : 0;
+}
+
+static int work_available (struct worker*me)
+{
+	int i, n;
+
+	if (cl_atomic_read (&shared_rq.len) ) return 1;
+	if (cl_atomic_read (&me->flow_rq.len) ) return 1;
+	if (ring_len() ) return 1;
+
+	n = cl_atomic_read (&nworkers);
+	for (i = 0;i < n;++i)
+		if (cl_atomic_read (&workers[i].rq.len)
+		        || flow_stealable (workers + i) ) return 1;
+
+	return 0;
+}
+
+static uint64_t next_timer (struct worker*me)
+{
+	/* time of our nearest timer or shared one, 0 if there's none */
+
+	uint64_t a, b;
+
+	a = cl_atomic_read (&me->timers.next);
+	b = cl_atomic_read (&shared_timers.next);
+
+	return (!a || (b && b < a) ) ? b : a;
+}
+
+static void park (struct worker*me)
+{
+	uint64_t next, now;
+
+	cl_mutex_lock (me->park_mutex);
+
+	me->parked = 1;
+	cl_atomic_add (&nparked, 1);
+
+	/*
+	 * Scheduling side first adds the work and then looks for parked
+	 * workers, we do it in reverse. As both are full barriers, one of us
+	 * is going to notice the other. Same goes for the shared timers.
+	 */
+
+	next = next_timer (me);
+
+	if (work_available (me) || ! (*me->keep_running)
+	        || (next && next <= cl_clock_usec() ) ) {
+		me->parked = 0;
+		cl_atomic_sub (&nparked, 1);
+	} else while (me->parked) {
+			if (!next) cl_cond_wait (me->park_cond, me->park_mutex);
+			else if ( (now = cl_clock_usec() ) >= next
+			          || cl_cond_timedwait (me->park_cond,
+			                                me->park_mutex, next - now) ) {
+				/* timer is due, nobody woke us */
+				if (me->parked) {
+					me->parked = 0;
+					cl_atomic_sub (&nparked, 1);
+				}
+			}
+		}
+
+	cl_mutex_unlock (me->park_mutex);
+}
+
+static int steal_from (struct worker*v, struct work**out, int max)
+{
+	int len;
+
+	/* take at most a half, so the victim has something left */
+	len = (cl_atomic_read (&v->rq.len) + 1) / 2;
+	if (len > max) len = max;
+
+	if (len && (len = rq_pop_batch (&v->rq, out, len) ) ) return len;
+
+	/* steered works only above the threshold */
+	len = flow_stealable (v);
+	if (len > max) len = max;
+
+	if (len && (len = rq_pop_batch (&v->flow_rq, out, len) ) ) return len;
+
+	return 0;
+}
+
+static int steal_work (struct worker*me, struct work**out, int max)
+{
+	int i, n, self, len, pass;
+	struct worker*v;
+
+	n = cl_atomic_read (&nworkers);
+	self = me - workers;
+
+	/*
+	 * start with the neighbor, so that thieves don't all go one way. Other
+	 * nodes are robbed only if there's nothing on our node.
+	 */
+	for (pass = 0;pass < 2;++pass)
+		for (i = 1;i < n;++i) {
+			v = workers + (self + i) % n;
+			if ( (v->node == me->node) == pass) continue;
+
+			if ( (len = steal_from (v, out, max) ) ) {
+				if (pass) ++me->stats.steals_remote;
+				else ++me->stats.steals_local;
+				return len;
+			}
+		}
+
+	return 0;
+}
+
+static int get_work (struct worker*me, struct work**out, int max)
+{
+	int i, j, n;
+	struct runqueue *q[3], *t;
+
+	/* try own, steered and shared queue, the most urgent first */
+	q[0] = &me->rq;
+	q[1] = &me->flow_rq;
+	q[2] = &shared_rq;
+
+	for (i = 1;i < 3;++i)
+		for (j = i;j > 0 && cl_atomic_read (&q[j]->top)
+		        < cl_atomic_read (&q[j-1]->top);--j) {
+			t = q[j];
+			q[j] = q[j-1];
+			q[j-1] = t;
+		}
+
+	/* ring has no priorities, only the deadlines go before it */
+	if (use_ring && cl_atomic_read (&q[0]->top) != DEADLINE_TOP
+	        && (n = ring_pop_batch (out, max) ) ) return n;
+
+	for (i = 0;i < 3;++i)
+		if ( (n = rq_pop_batch (q[i], out, max) ) ) return n;
+
+	return steal_work (me, out, max);
+}
+
+static int idle (struct worker*me, struct work**out, int max)
+{
+	/* spin, then yield, then park. Returns the work if any was found. */
+
+	uint64_t start, now, end;
+	int i, n;
+
+	start = now = cl_clock_usec();
+
+	end = start + idle_spin_usec;
+	while (now < end) {
+		for (i = 0;i < SPIN_CHECK;++i) cl_cpu_relax();
+		if (work_available (me) && (n = get_work (me, out, max) ) ) {
+			me->stats.spin_time += cl_clock_usec() - start;
+			++me->stats.spin_found;
+			return n;
+		}
+		now = cl_clock_usec();
+	}
+
+	me->stats.spin_time += now - start;
+	start = now;
+
+	end = start + idle_yield_usec;
+	while (now < end) {
+		cl_thread_yield();
+		if (work_available (me) && (n = get_work (me, out, max) ) ) {
+			me->stats.yield_time += cl_clock_usec() - start;
+			++me->stats.yield_found;
+			return n;
+		}
+		now = cl_clock_usec();
+	}
+
+	me->stats.yield_time += now - start;
+	start = now;
+
+	park (me);
+
+	me->stats.park_time += cl_clock_usec() - start;
+	++me->stats.parks;
+
+	return 0;
+}
+
+static void check_poll_latency (struct worker*me)
+{
+	uint64_t now, last;
+	int loop;
+
+	if (!poll_latency_usec) return;
+
+	/* look after the loop we'd normally poll */
+	loop = (me - workers) % cloudvpn_event_loops();
+
+	last = cl_atomic_read (last_poll + loop);
+	now = cl_clock_usec();
+
+	if (now - last < (uint64_t) poll_latency_usec) return;
+
+	/* only one of us goes polling */
+	if (!cl_atomic_cas (last_poll + loop, last, now) ) return;
+
+	cloudvpn_poll_event (loop);
+}
+
+static struct worker* loop_owner (int loop)
+{
+	/* worker that should poll the event loop, if there's any */
+
+	struct worker*t;
+
+	if (cloudvpn_event_loops() < 2 || loop >= cl_atomic_read (&nworkers) )
+		return 0;
+
+	t = workers + loop;
+	return cl_atomic_read (&t->active) ? t : 0;
+}
+
+static struct worker* flow_target (struct work*w)
+{
+	/*
+	 * hash the destination and source address part of the packet (they
+	 * are next to each other) and choose a worker.
+	 */
+
+	struct packet*p;
+	uint32_t h;
+	int i, n;
+	struct worker*t;
+
+	if (!flow_steering || w->type != work_packet) return 0;
+
+	p = w->p;
+	if (!p || !p->data || p->doff > p->len) return 0;
+
+	h = 2166136261U; /* FNV-1a */
+	for (i = 0;i < p->doff;++i) {
+		h ^= (uint8_t) p->data[i];
+		h *= 16777619U;
+	}
+
+	n = cl_atomic_read (&nworkers);
+	if (!n) return 0;
+
+	t = workers + (h % n);
+	if (!cl_atomic_read (&t->active) ) return 0;
+
+	return t;
+}
+
+static int enqueue_work (struct work*w)
+{
+	int r;
+
+	if (use_ring && !w->deadline) {
+		if (use_telemetry) w->enqueued = cl_clock_nsec();
+		if (!ring_push (w) ) {
+			wake_some_workers (1);
+			return schedule_ok;
+		}
+	}
+
+	r = rq_push (this_worker ? & (this_worker->rq) : &shared_rq, w);
+
+	/* if anyone is idle, let him steal it */
+	if (r != schedule_dropped) wake_some_workers (1);
+
+	return r;
+}
+
+static int steer_work (struct worker*t, struct work*w)
+{
+	int r;
+
+	/* target may have left since it was chosen */
+	r = rq_push_if (&t->flow_rq, w, &t->active);
+	if (r == schedule_error) {
+		r = rq_push (&shared_rq, w);
+		if (r != schedule_dropped) wake_some_workers (1);
+		return r;
+	}
+	if (r == schedule_dropped) return r;
+
+	/* make sure the owner runs, and if it has too much, get some help */
+	if (cl_atomic_read (&t->polling) )
+		cloudvpn_event_wakeup (cl_atomic_read (&t->poll_loop) );
+
+	if (cl_atomic_get (&nparked) ) {
+		if (wake_worker (t) ) cl_atomic_add (&wakeups_sent, 1);
+		else if (flow_stealable (t) ) wake_some_workers (1);
+	}
+
+	return r;
+}
+
+static void begin_work (struct worker*me, struct work*w)
+{
+	me->cur_prio = w->deadline ? DEADLINE_TOP : w->priority;
+	if (yield_slice) me->work_start = cl_clock_nsec();
+}
+
+/*
+ * telemetry
+ */
+
+static void hist_add (struct sched_histogram*h, uint64_t t)
+{
+	int i;
+
+	/* bucket is the number of bits of t */
+	i = t ? 64 - __builtin_clzll (t) : 0;
+	if (i >= SCHED_HIST_BUCKETS) i = SCHED_HIST_BUCKETS - 1;
+
+	++h->count[i];
+	h->total += t;
+}
+
+static void record_wait (struct worker*me, struct work*w, uint64_t now)
+{
+	/* works that were queued before telemetry got enabled have no stamp */
+	if (!w->enqueued || w->enqueued > now) return;
+
+	hist_add (& (me->tm->prio[w->priority].wait), now - w->enqueued);
+	if (w->type < WORK_TYPES)
+		hist_add (& (me->tm->type[w->type].wait), now - w->enqueued);
+}
+
+static void record_service (struct worker*me, int prio, int type, uint64_t t)
+{
+	/* work itself might be gone already, so it gets just the numbers */
+	hist_add (& (me->tm->prio[prio].service), t);
+	if (type < WORK_TYPES) hist_add (& (me->tm->type[type].service), t);
+}
+
+/*
+ * parts and mailboxes
+ */
+
+static struct part* work_target (struct work*w)
+{
+	switch (w->type) {
+	case work_packet:
+		return w->p ? w->p->next_part : 0;
+	case work_event:
+		return w->e.owner;
+	case work_continuation:
+		return w->c.owner;
+	case work_io:
+		return w->io.owner;
+	}
+	return 0;
+}
+
+static uint64_t dispatch_work (struct part*pt, struct work*w)
+{
+	/* returns the time it took, in nanoseconds */
+
+	uint64_t t;
+
+	if (! (pt->p && pt->p->process_work) ) return 0;
+
+	t = cl_clock_nsec();
+	pt->p->process_work (pt, w);
+	t = cl_clock_nsec() - t;
+
+	if (pt->mbox) {
+		cl_atomic_add (& (pt->mbox->cpu_time), t);
+		cl_atomic_add (& (pt->mbox->works), 1);
+	}
+
+	return t;
+}
+
+struct mailbox* cloudvpn_new_mailbox (struct part*pt) {
+
+	struct mailbox*mb;
+
+	mb = cl_malloc (sizeof (struct mailbox) );
+	if (!mb) return 0;
+
+	if (cl_mutex_init (&mb->m) ) {
+		cl_free (mb);
+		return 0;
+	}
+
+	mb->pt = pt;
+	mb->head = mb->tail = 0;
+	mb->len = 0;
+	mb->scheduled = mb->boosted = mb->draining = mb->dead = 0;
+
+	mb->weight = 1;
+	mb->deficit = 0;
+	mb->cpu_time = mb->works = 0;
+
+	mb->w.type = work_mailbox;
+	mb->w.is_static = 1;
+	mb->w.deadline = mb->w.enqueued = 0;
+	mb->w.mb = mb;
+	mb->urgent = mb->w;
+
+	return mb;
+}
+
+static void mailbox_free (struct mailbox*mb)
+{
+	cl_mutex_destroy (mb->m);
+	cl_free (mb);
+}
+
+static struct work* mailbox_take_all (struct mailbox*mb)
+{
+	/* expects the mailbox to be locked */
+	struct work*list = mb->head;
+	mb->head = mb->tail = 0;
+	return list;
+}
+
+static void drop_list (struct work*list)
+{
+	struct work*w;
+
+	while (list) {
+		w = list;
+		list = list->next;
+		if (! (w->is_static) ) drop_work (w);
+	}
+}
+
+static int mailbox_release (struct mailbox*mb, struct work*token)
+{
+	/*
+	 * expects the mailbox to be locked. Token got out of the queue, return
+	 * whether the mailbox was deleted and nothing refers to it anymore.
+	 */
+
+	if (token == & (mb->urgent) ) mb->boosted = 0;
+	else mb->scheduled = 0;
+
+	return mb->dead && !mb->scheduled && !mb->boosted && !mb->draining;
+}
+
+static void mailbox_forget (struct mailbox*mb, struct work*token)
+{
+	/* token is thrown away with the queue it was in, and so is the work */
+
+	struct work*list;
+	int release;
+
+	cl_mutex_lock (mb->m);
+	release = mailbox_release (mb, token);
+	list = mailbox_take_all (mb);
+	cl_mutex_unlock (mb->m);
+
+	drop_list (list);
+	if (release) mailbox_free (mb);
+}
+
+void cloudvpn_delete_mailbox (struct mailbox*mb)
+{
+	/*
+	 * works of the mailbox may still be queued or draining, the last one
+	 * of them frees it. Works that wait in it are dropped.
+	 */
+
+	struct work*list;
+	int idle;
+
+	cl_mutex_lock (mb->m);
+	mb->dead = 1;
+	list = mailbox_take_all (mb);
+	idle = !mb->scheduled && !mb->boosted && !mb->draining;
+	cl_mutex_unlock (mb->m);
+
+	drop_list (list);
+	if (idle) mailbox_free (mb);
+}
+
+static int more_urgent (struct work*a, struct work*b)
+{
+	/* whether a goes before b, deadlines first */
+	if (a->deadline || b->deadline)
+		return a->deadline && (!b->deadline || a->deadline < b->deadline);
+	return a->priority < b->priority;
+}
+
+static struct work* mailbox_wake (struct mailbox*mb, struct work*w)
+{
+	/*
+	 * expects the mailbox to be locked. Returns which of its works should
+	 * be queued so that w gets processed in time, or 0 if none.
+	 */
+
+	struct work*t;
+
+	if (mb->dead || mb->draining || mb->boosted) return 0;
+
+	if (!mb->scheduled) {
+		t = & (mb->w);
+		mb->scheduled = 1;
+	} else if (more_urgent (w, & (mb->w) ) ) {
+		t = & (mb->urgent);
+		mb->boosted = 1;
+	} else return 0;
+
+	t->priority = w->priority;
+	t->deadline = w->deadline;
+	return t;
+}
+
+static int mailbox_post (struct mailbox*mb, struct work*w)
+{
+	int r;
+	struct work *dropped = 0, *prev, **pp, *t;
+
+	w->next = 0;
+	if (use_telemetry) w->enqueued = cl_clock_nsec();
+
+	cl_mutex_lock (mb->m);
+
+	if (mb->dead) {
+		cl_mutex_unlock (mb->m);
+		drop_work (w);
+		return schedule_dropped;
+	}
+
+	/* mailbox is one FIFO, so the limit goes for all it holds */
+	r = admit (w, cl_atomic_read (&mb->len) );
+
+	if (r == schedule_dropped) {
+		cl_mutex_unlock (mb->m);
+		drop_work (w);
+		return r;
+	}
+
+	if (r == schedule_congested && mb->len >= capacity[w->priority]) {
+		/* the oldest work of the same kind goes, or the new one */
+		for (prev = 0, pp = & (mb->head);*pp;prev = *pp, pp = & (prev->next) )
+			if (evictable (*pp, w->priority) ) break;
+
+		if (! (dropped = *pp) ) {
+			cl_mutex_unlock (mb->m);
+			drop_work (w);
+			return schedule_dropped;
+		}
+
+		*pp = dropped->next;
+		if (mb->tail == dropped) mb->tail = prev;
+		cl_atomic_sub (&mb->len, 1);
+	}
+
+	if (mb->tail) mb->tail->next = w;
+	else mb->head = w;
+	mb->tail = w;
+	cl_atomic_add (&mb->len, 1);
+
+	t = mailbox_wake (mb, w);
+
+	cl_mutex_unlock (mb->m);
+
+	if (dropped) drop_work (dropped);
+
+	if (t) enqueue_work (t);
+
+	return r;
+}
+
+static void mailbox_drain (struct mailbox*mb, struct work*token)
+{
+	int i, release;
+	struct work *list, *w;
+	uint64_t t;
+
+	/* the other work of the mailbox may be draining it already */
+	cl_mutex_lock (mb->m);
+
+	if (mailbox_release (mb, token) ) {
+		cl_mutex_unlock (mb->m);
+		mailbox_free (mb);
+		return;
+	}
+
+	if (mb->draining || mb->dead) {
+		cl_mutex_unlock (mb->m);
+		return;
+	}
+	mb->draining = 1;
+
+	cl_mutex_unlock (mb->m);
+
+	mb->deficit += mb->weight * (int64_t) DRR_QUANTUM;
+
+	while (mb->deficit > 0) {
+
+		/* take a batch of works at once */
+		cl_mutex_lock (mb->m);
+
+		if (mb->dead) {
+			cl_mutex_unlock (mb->m);
+			break;
+		}
+
+		list = mb->head;
+		for (i = 1, w = list;w && i < MAILBOX_BATCH;++i) w = w->next;
+
+		if (w) {
+			mb->head = w->next;
+			w->next = 0;
+			if (!mb->head) mb->tail = 0;
+		} else mb->head = mb->tail = 0;
+
+		cl_mutex_unlock (mb->m);
+
+		if (!list) break;
+
+		/* part may get deleted meanwhile, stop then */
+		while (list && mb->deficit > 0 && !cl_atomic_read (&mb->dead) ) {
+			w = list;
+			list = list->next;
+
+			if (use_telemetry) record_wait (this_worker, w, cl_clock_nsec() );
+			begin_work (this_worker, w);
+
+			/* charge at least something, so the turn always ends */
+			t = dispatch_work (mb->pt, w);
+			mb->deficit -= t + 1;
+
+			if (use_telemetry)
+				record_service (this_worker, w->priority, w->type, t);
+			cl_atomic_sub (&mb->len, 1);
+
+			if (! (w->is_static) ) cloudvpn_delete_work (w);
+		}
+
+		if (list) {
+			/* our time is over, return the rest of the batch */
+			for (w = list;w->next;w = w->next);
+
+			cl_mutex_lock (mb->m);
+			w->next = mb->head;
+			if (!mb->head) mb->tail = w;
+			mb->head = list;
+			cl_mutex_unlock (mb->m);
+		}
+	}
+
+	/* if there's more, go to the end of the queue to let others run */
+	cl_mutex_lock (mb->m);
+
+	mb->draining = 0;
+
+	/* parts that have nothing to do don't save up the time */
+	if (!mb->head) mb->deficit = 0;
+
+	w = mb->head ? mailbox_wake (mb, mb->head) : 0;
+
+	/* if the part was deleted, the rest of our batch is dropped here */
+	release = mb->dead && !mb->scheduled && !mb->boosted;
+	list = mb->dead ? mailbox_take_all (mb) : 0;
+
+	cl_mutex_unlock (mb->m);
+
+	drop_list (list);
+	if (release) mailbox_free (mb);
+
+	if (w) enqueue_work (w);
+}
+
+void cloudvpn_scheduler_set_mailboxes (int enable)
+{
+	use_mailboxes = enable;
+}
 
-static struct work_queue *queue;
-static cl_mutex queue_mutex;
-static cl_cond queue_just_filled;
+void cloudvpn_part_set_weight (struct part*pt, int weight)
+{
+	if (pt->mbox) pt->mbox->weight = weight > 0 ? weight : 1;
+}
+
+void cloudvpn_part_sched_stats (struct part*pt, struct part_sched_stats*s)
+{
+	s->cpu_time = pt->mbox ? cl_atomic_read (& (pt->mbox->cpu_time) ) : 0;
+	s->works = pt->mbox ? cl_atomic_read (& (pt->mbox->works) ) : 0;
+}
 
-/* static work for event waiting that gets never deleted */
-static struct work event_poll_work;
+/*
+ * scheduler frontend
+ */
 
 struct work* cloudvpn_new_work() {
-	return cl_malloc (sizeof (struct work) );
+	struct work*w = cl_slab_alloc (work_slab);
+	if (w) {
+		w->deadline = w->enqueued = 0;
+		w->ev = 0;
+	}
+	return w;
+}
+
+void cloudvpn_delete_work (struct work*w)
+{
+	/* processed or dropped, persistent event can fire again */
+	if (w->type == work_event && w->ev) cloudvpn_event_done (w->ev);
+	if (w->type == work_io && w->io.s) cloudvpn_io_done (w->io.s);
+
+	cl_slab_free (work_slab, w);
 }
 
 int cloudvpn_schedule_work (struct work*w)
 /* inserts work into the queue */
 {
-	struct work_queue** q;
-	struct work_queue* nw;
+	struct worker*t;
+	struct part*pt;
 
-	nw = cl_malloc (sizeof (struct work_queue) );
-	if (!nw) return 1;
-	nw->w = w;
+	if (use_mailboxes && (pt = work_target (w) ) && pt->mbox)
+		return mailbox_post (pt->mbox, w);
 
-	cl_mutex_lock (queue_mutex);
+	if ( (t = flow_target (w) ) ) return steer_work (t, w);
 
-	q = &queue;
+	if (w->type == work_poll && (t = loop_owner (w->loop) ) )
+		return steer_work (t, w);
 
-	while ( (*q) && ( (*q)->w->priority <= w->priority) )
-		q = & ( (*q)->next);
-
-	nw->next = *q;
-	*q = nw;
+	return enqueue_work (w);
+}
 
-	cl_mutex_unlock (queue_mutex);
+int cloudvpn_schedule_work_batch (struct work**w, int n)
+/* inserts n works into the queue, taking the lock only once */
+{
+	int i, count, r, worst = schedule_ok;
+	struct work *list, **tail;
+	struct worker*t;
+	struct part*pt;
 
 	/*
-	 * Now wake up some thread that processes the event. Note that waking
-	 * multiple threads (by broadcast) is not really neccessary, as one
-	 * scheduled work can be done only by one thread, and this function is
-	 * called for every scheduled work, waking as many threads as needed.
+	 * steered and mailboxed works go one by one, the rest is linked
+	 * together
 	 */
+	list = 0;
+	tail = &list;
+	count = 0;
+
+	for (i = 0;i < n;++i) {
+		r = schedule_ok;
+		if (use_mailboxes && (pt = work_target (w[i]) ) && pt->mbox)
+			r = mailbox_post (pt->mbox, w[i]);
+		else if ( (t = flow_target (w[i]) ) ) r = steer_work (t, w[i]);
+		else if (use_ring && !w[i]->deadline) r = enqueue_work (w[i]);
+		else {
+			*tail = w[i];
+			tail = & (w[i]->next);
+			++count;
+		}
+		if (r > worst) worst = r;
+	}
 
-	cl_cond_signal (queue_just_filled);
+	*tail = 0;
 
-	return 0;
+	if (!count) return worst;
+
+	r = rq_push_list (this_worker ? & (this_worker->rq) : &shared_rq,
+	                  list, &count);
+	if (r > worst) worst = r;
+
+	if (count) wake_some_workers (count);
+
+	return worst;
+}
+
+int cloudvpn_handoff_work (struct work*w)
+/* runs the work inline if direct dispatch allows it, or schedules it */
+{
+	struct worker*t;
+	struct part*pt;
+	struct worker*me = this_worker;
+
+	if (!direct_depth || !me || w->type != work_packet
+	        || direct_level >= direct_depth
+	        || ! (pt = work_target (w) ) ) goto schedule;
+
+	/* these need the queue to keep serial processing or flow order */
+	if (use_mailboxes && pt->mbox) goto schedule;
+	/* earlier packets of our flows may still wait in the queue */
+	if ( (t = flow_target (w) )
+	        && (t != me || cl_atomic_read (&me->flow_rq.len) ) ) goto schedule;
+
+	if (!direct_level) direct_start = cl_clock_nsec();
+	else if (cl_clock_nsec() - direct_start > direct_budget) goto schedule;
+
+	++me->stats.direct_works;
+
+	++direct_level;
+	dispatch_work (pt, w);
+	--direct_level;
+
+	if (! (w->is_static) ) cloudvpn_delete_work (w);
+
+	return schedule_ok;
+
+schedule:
+	if (me && direct_depth) ++me->stats.direct_fallbacks;
+	return cloudvpn_schedule_work (w);
+}
+
+static void wake_timer_waiters()
+{
+	/* make someone look at the shared timers again */
+
+	int i, n;
+
+	n = cl_atomic_read (&nworkers);
+
+	for (i = 0;i < n;++i) if (cl_atomic_read (&workers[i].polling) )
+			cloudvpn_event_wakeup (cl_atomic_read (&workers[i].poll_loop) );
+
+	for (i = 0;i < n;++i)
+		if (cl_atomic_read (&workers[i].parked)
+		        && wake_worker (workers + i) ) {
+			cl_atomic_add (&wakeups_sent, 1);
+			break;
+		}
+}
+
+int cloudvpn_schedule_work_at (struct work*w, uint64_t t)
+{
+	struct timerheap*th;
+	int r, first;
+
+	if (t <= cl_clock_usec() ) return cloudvpn_schedule_work (w);
+
+	w->at = t;
+	th = this_worker ? & (this_worker->timers) : &shared_timers;
+
+	cl_mutex_lock (th->m);
+	r = th_insert (th, w);
+	first = (th->next == t);
+	cl_mutex_unlock (th->m);
+
+	if (r) return schedule_error;
+
+	/* we check our own timers, but others may sleep past this one */
+	if (first && th == &shared_timers) wake_timer_waiters();
+
+	return schedule_ok;
+}
+
+static void run_timers (struct timerheap*th, uint64_t now)
+{
+	struct work*batch[TIMER_BATCH];
+	int n;
+
+	do {
+		if (cl_atomic_read (&th->next) > now || !cl_atomic_read (&th->len) )
+			return;
+
+		/* if someone else is doing it, let him */
+		if (cl_mutex_trylock (th->m) ) return;
+
+		n = 0;
+		while (n < TIMER_BATCH && th->len && th->next <= now)
+			batch[n++] = th_remove (th);
+
+		cl_mutex_unlock (th->m);
+
+		if (n) cloudvpn_schedule_work_batch (batch, n);
+
+	} while (n == TIMER_BATCH);
+}
+
+static void check_timers (struct worker*me)
+{
+	uint64_t now;
+
+	if (!cl_atomic_read (&me->timers.len)
+	        && !cl_atomic_read (&shared_timers.len) ) return;
+
+	now = cl_clock_usec();
+
+	run_timers (& (me->timers), now);
+	run_timers (&shared_timers, now);
+}
+
+int cloudvpn_schedule_continuation (struct part*pt, void*state, int priority)
+{
+	struct work*w;
+
+	w = cloudvpn_new_work();
+	if (!w) return schedule_error;
+
+	w->type = work_continuation;
+	w->priority = priority;
+	w->is_static = 0;
+	w->c.owner = pt;
+	w->c.state = state;
+
+	return cloudvpn_schedule_work (w);
+}
+
+int cloudvpn_should_yield()
+{
+	int top, t;
+	struct worker*me = this_worker;
+
+	if (!me) return 0;
+
+	/* tops are read without locks, which is good enough for a hint */
+	top = cl_atomic_read (&me->rq.top);
+	if ( (t = cl_atomic_read (&me->flow_rq.top) ) < top) top = t;
+	if ( (t = cl_atomic_read (&shared_rq.top) ) < top) top = t;
+
+	if (top < me->cur_prio) return 1;
+
+	return yield_slice && (top != EMPTY_TOP || ring_len() )
+	       && cl_clock_nsec() - me->work_start > yield_slice;
 }
 
 int cloudvpn_scheduler_init()
 {
-	queue = 0;
+	int i;
+
+	nworkers = 0;
+	nparked = npolling = 0;
+	wakeups_sent = wakeups_saved = 0;
+	for (i = 0;i < MAX_EVENT_LOOPS;++i) {
+		last_poll[i] = cl_clock_usec();
 
-	event_poll_work.type = work_poll;
-	event_poll_work.priority = LOWEST_PRIORITY;
-	event_poll_work.is_static = 1;
+		poll_works[i].type = work_poll;
+		poll_works[i].priority = LOWEST_PRIORITY;
+		poll_works[i].is_static = 1;
+		poll_works[i].loop = i;
+	}
+
+	work_slab = cl_slab_new (struct work);
+	if (!work_slab) return 1;
 
-	return cl_mutex_init (&queue_mutex) ||
-	       cl_cond_init (&queue_just_filled);
+	return rq_init (&shared_rq) ||
+	       th_init (&shared_timers) ||
+	       cl_mutex_init (&workers_mutex);
 }
 
 int cloudvpn_scheduler_destroy()
 {
-	struct work_queue*p;
+	int i, r = 0;
+	struct work*p;
+
+	for (i = 0;i < nworkers;++i) {
+		r |= rq_destroy (& (workers[i].rq) );
+		r |= rq_destroy (& (workers[i].flow_rq) );
+		r |= cl_mutex_destroy (workers[i].park_mutex);
+		r |= cl_cond_destroy (workers[i].park_cond);
+		r |= th_destroy (& (workers[i].timers) );
+		cl_free (workers[i].tm);
+	}
+
+	nworkers = 0;
+
+	if (use_ring) {
+		while ( (p = ring_pop() ) )
+			if (! (p->is_static) ) drop_work (p);
+			else if (p->type == work_mailbox) mailbox_forget (p->mb, p);
+		cl_free (ring.slot);
+		ring.slot = 0;
+		use_ring = 0;
+	}
+
+	r = r ||
+	    rq_destroy (&shared_rq) ||
+	    th_destroy (&shared_timers) ||
+	    cl_mutex_destroy (workers_mutex);
+
+	cl_slab_destroy (work_slab);
+
+	return r;
+}
+
+void cloudvpn_scheduler_set_steering (int enable, int steal_threshold)
+{
+	flow_steering = enable;
+	flow_steal_threshold = steal_threshold;
+}
+
+void cloudvpn_scheduler_set_idle_policy (int spin_usec, int yield_usec)
+{
+	idle_spin_usec = spin_usec;
+	idle_yield_usec = yield_usec;
+}
+
+void cloudvpn_scheduler_wakeup_stats (uint64_t*sent, uint64_t*saved)
+{
+	*sent = cl_atomic_get (&wakeups_sent);
+	*saved = cl_atomic_get (&wakeups_saved);
+}
+
+void cloudvpn_scheduler_set_poll_latency (int usec)
+{
+	poll_latency_usec = usec;
+}
+
+int cloudvpn_scheduler_set_ring (int size)
+{
+	uint64_t i, n;
+
+	/* can be done only once, before anything gets scheduled */
+	if (ring.slot) return 1;
+	if (size <= 0) return 0;
+
+	for (n = 2;n < (uint64_t) size;n *= 2);
+
+	if (cl_aligned_alloc ( (void**) &ring.slot, CACHE_LINE,
+	                       n * sizeof (struct ring_slot) ) ) {
+		ring.slot = 0;
+		return 1;
+	}
+
+	for (i = 0;i < n;++i) ring.slot[i].seq = i;
+
+	ring.mask = n - 1;
+	ring.enqueue_pos = ring.dequeue_pos = 0;
+
+	cl_barrier();
+	use_ring = 1;
+
+	return 0;
+}
+
+void cloudvpn_scheduler_set_yield_slice (int usec)
+{
+	yield_slice = 1000 * (uint64_t) (usec > 0 ? usec : 0);
+}
+
+void cloudvpn_scheduler_set_direct_dispatch (int depth, int budget_usec)
+{
+	direct_depth = depth > 0 ? depth : 0;
+	direct_budget = 1000 * (uint64_t) (budget_usec > 0 ? budget_usec : 0);
+}
+
+void cloudvpn_scheduler_set_limit (int priority, int cap, int policy)
+{
+	int i;
+
+	if (priority < 0) {
+		for (i = 0;i < PRIORITIES;++i)
+			cloudvpn_scheduler_set_limit (i, cap, policy);
+		return;
+	}
+
+	if (priority >= PRIORITIES) return;
+
+	capacity[priority] = cap > 0 ? cap : 0;
+	drop_policy[priority] = policy;
+}
+
+uint64_t cloudvpn_scheduler_drops (int priority)
+{
+	int i;
+	uint64_t r = 0;
+
+	if (priority >= PRIORITIES) return 0;
+	if (priority >= 0) return cl_atomic_read (drops + priority);
+
+	for (i = 0;i < PRIORITIES;++i) r += cl_atomic_read (drops + i);
+
+	return r;
+}
+
+int cloudvpn_scheduler_workers()
+{
+	return cl_atomic_read (&nworkers);
+}
+
+int cloudvpn_scheduler_worker_stats (int i, struct sched_worker_stats*s)
+{
+	struct worker*w;
+
+	if (i < 0 || i >= cl_atomic_read (&nworkers) ) return 1;
+
+	w = workers + i;
+
+	memcpy (s, & (w->stats), sizeof (struct sched_worker_stats) );
+
+	s->queue_len = cl_atomic_read (&w->rq.len);
+	s->queue_max = cl_atomic_read (&w->rq.max_len);
+	s->flow_queue_len = cl_atomic_read (&w->flow_rq.len);
+	s->flow_queue_max = cl_atomic_read (&w->flow_rq.max_len);
+
+	return 0;
+}
+
+void cloudvpn_scheduler_set_telemetry (int enable)
+{
+	use_telemetry = enable;
+}
+
+static void hist_sum (struct sched_histogram*to, struct sched_histogram*h)
+{
+	int i;
+
+	for (i = 0;i < SCHED_HIST_BUCKETS;++i)
+		to->count[i] += cl_atomic_read (h->count + i);
+	to->total += cl_atomic_read (&h->total);
+}
+
+int cloudvpn_scheduler_telemetry (int by, int index, struct sched_telemetry*s)
+{
+	/*
+	 * Histograms are read while the workers write them, so the snapshot
+	 * may be a bit inconsistent, but that's the price for not locking.
+	 */
+
+	int i, n;
+	struct sched_telemetry*t;
+
+	if (by == telemetry_priority) {
+		if (index < 0 || index >= PRIORITIES) return 1;
+	} else if (by == telemetry_type) {
+		if (index < 0 || index >= WORK_TYPES) return 1;
+	} else return 1;
+
+	memset (s, 0, sizeof (struct sched_telemetry) );
 
-	while (queue) {
-		p = queue;
-		queue = queue->next;
-		cl_free (p->w);
-		cl_free (p);
+	n = cl_atomic_read (&nworkers);
+	for (i = 0;i < n;++i) {
+		if (by == telemetry_priority) t = workers[i].tm->prio + index;
+		else t = workers[i].tm->type + index;
+
+		hist_sum (& (s->wait), & (t->wait) );
+		hist_sum (& (s->service), & (t->service) );
 	}
 
-	return cl_mutex_destroy (queue_mutex) ||
-	       cl_cond_destroy (queue_just_filled);
+	return 0;
+}
+
+uint64_t cloudvpn_scheduler_shared_queue_max()
+{
+	return cl_atomic_read (&shared_rq.max_len);
+}
+
+void cloudvpn_scheduler_wakeup_all()
+{
+	/* used to notice changed keep_running */
+
+	int i, n;
+
+	n = cl_atomic_read (&nworkers);
+	for (i = 0;i < n;++i) wake_worker (workers + i);
 }
 
 void cloudvpn_schedule_event_poll()
@@ -103,17 +2142,27 @@ void cloudvpn_schedule_event_poll()
 	/* This should be explicitely get called once at the beginning. Event
 	 * waiting then reschedules it. */
 
-	cloudvpn_schedule_work (&event_poll_work);
+	int i;
+
+	for (i = 0;i < cloudvpn_event_loops();++i)
+		cloudvpn_schedule_work (poll_works + i);
 }
 
 static void do_work (struct work* w)
 {
+	struct part*pt;
+
 	/* TODO fill this with functionality */
 	switch (w->type) {
 	case work_packet:
+	case work_event:
+	case work_continuation:
+	case work_io:
+		if ( (pt = work_target (w) ) ) dispatch_work (pt, w);
 		break;
 
-	case work_event:
+	case work_mailbox:
+		mailbox_drain (w->mb, w);
 		break;
 
 	case work_part_cleanup:
@@ -126,43 +2175,101 @@ static void do_work (struct work* w)
 		break;
 
 	case work_poll:
-		cloudvpn_wait_for_event();
-		cloudvpn_schedule_event_poll();
+		/*
+		 * don't block in the event loop while any queued work (or rest
+		 * of our batch) waits. Work scheduled after the check wakes the
+		 * loop up, see wake_some_workers. Rescheduling sends the poll to
+		 * the loop's own worker, but anyone idle can steal it meanwhile.
+		 */
+		this_worker->poll_loop = w->loop;
+		cl_atomic_add (&this_worker->polling, 1);
+		cl_atomic_add (&npolling, 1);
+		if (!cl_atomic_read (&this_worker->flow_rq.len)
+		        && !cl_atomic_read (&this_worker->rq.len)
+		        && !cl_atomic_read (&shared_rq.len)
+		        && !ring_len()
+		        && !this_worker->batch_left)
+			cloudvpn_wait_for_event_until (w->loop,
+			                               next_timer (this_worker) );
+		cl_atomic_sub (&npolling, 1);
+		cl_atomic_sub (&this_worker->polling, 1);
+		last_poll[w->loop] = cl_clock_usec();
+		cloudvpn_schedule_work (w);
 		break;
 	}
 }
 
+/*
+ * Workers take several works at once, so they don't need to lock the queue
+ * for each of them. The batch is small so the works don't get stuck in the
+ * private batch while other workers idle.
+ */
+
+#define WORK_BATCH 8
+
 int cloudvpn_scheduler_run (int* keep_running)
 {
-	struct work_queue*p;
+	struct worker*me;
+	struct work*batch[WORK_BATCH];
 	struct work*w;
+	int i, n, prio, type;
+	uint64_t start = 0;
+
+	me = worker_register();
+	if (!me) return 1;
+
+	me->keep_running = keep_running;
+
+	this_worker = me;
 
 	while (*keep_running) {
 
-		cl_mutex_lock (queue_mutex);
+		check_timers (me);
 
-		if (!queue) {
-			/* just wait for the signal and retry */
-			cl_cond_wait (queue_just_filled, queue_mutex);
-			cl_mutex_unlock (queue_mutex);
+		n = get_work (me, batch, WORK_BATCH);
 
-		} else {
+		if (!n) n = idle (me, batch, WORK_BATCH);
+
+		/* if we were parked, just retry */
+		if (!n) continue;
+
+		for (i = 0;i < n;++i) {
+			w = batch[i];
 
-			p = queue;
-			queue = queue->next;
+			if (w->deadline) {
+				++me->stats.deadline_works;
+				if (cl_clock_usec() > w->deadline)
+					++me->stats.deadline_misses;
+			}
 
-			cl_mutex_unlock (queue_mutex);
+			if (use_telemetry) {
+				start = cl_clock_nsec();
+				record_wait (me, w, start);
+			}
 
-			w = p->w;
-			cl_free (p);
+			/* static works may get rescheduled (and changed) inside */
+			prio = w->priority;
+			type = w->type;
 
+			begin_work (me, w);
+			me->batch_left = n - i - 1;
 			do_work (w);
 
+			if (use_telemetry)
+				record_service (me, prio, type,
+				                cl_clock_nsec() - start);
+
 			/* don't delete statically assigned work */
-			if (! (w->is_static) ) cl_free (w);
+			if (! (w->is_static) ) cloudvpn_delete_work (w);
 		}
+
+		check_poll_latency (me);
 	}
 
+	this_worker = 0;
+
+	worker_unregister (me);
+
 	return 0;
 }
 
@@ -0,0 +1,324 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "alloc.h"
+#include "mutex.h"
+#include "thread.h"
+#include "topology.h"
+
+/*
+ * Object caches, done the magazine way.
+ *
+ * Magazine is a small stack of free objects. Every thread has two of them
+ * for each slab, and allocates from/frees to them without any locking. When
+ * both are empty (or full), the thread trades one of them in the depot, which
+ * is a locked stack of full and empty magazines shared by all threads. Only
+ * when depot can't help, we go to the real allocator.
+ *
+ * There's one depot for each numa node, and threads trade only with the depot
+ * of the node they started on. Objects therefore don't wander between the
+ * nodes much, and new ones are allocated (and first touched) by a thread on
+ * the node where they are going to be used.
+ */
+
+#define MAG_SIZE 32
+#define DEPOT_MAX 64 /* full magazines kept in depot, the rest is freed */
+
+struct magazine {
+	struct magazine*next;
+	int n;
+	void*obj[MAG_SIZE];
+};
+
+struct slab_depot {
+	cl_mutex m;
+	struct magazine *full, *empty;
+	int nfull;
+
+	struct slab_cache*caches; /* so we can clean them up */
+};
+
+struct slab_cache {
+	struct magazine *loaded, *prev;
+	struct slab_depot*d;
+	struct slab_cache *next, **pprev;
+};
+
+struct cl_slab {
+	size_t size;
+	cl_tls cache_key;
+
+	int ndepots;
+	struct slab_depot*depot; /* one for each node */
+};
+
+static void magazine_free (struct magazine*m)
+{
+	while (m->n) cl_free (m->obj[--m->n]);
+	cl_free (m);
+}
+
+static struct magazine* magazine_new()
+{
+	struct magazine*m = cl_malloc (sizeof (struct magazine) );
+	if (m) m->n = 0;
+	return m;
+}
+
+/* expects the depot to be locked */
+static void depot_put (struct slab_depot*d, struct magazine*m)
+{
+	if (!m->n) {
+		m->next = d->empty;
+		d->empty = m;
+	} else if (d->nfull < DEPOT_MAX) {
+		m->next = d->full;
+		d->full = m;
+		++d->nfull;
+	} else magazine_free (m);
+}
+
+static void cache_release (void*p)
+{
+	/* called when the thread ends, return everything to depot */
+
+	struct slab_cache*c = p;
+	struct slab_depot*d = c->d;
+
+	cl_mutex_lock (d->m);
+
+	depot_put (d, c->loaded);
+	depot_put (d, c->prev);
+
+	*c->pprev = c->next;
+	if (c->next) c->next->pprev = c->pprev;
+
+	cl_mutex_unlock (d->m);
+
+	cl_free (c);
+}
+
+static struct slab_cache* get_cache (struct cl_slab*s)
+{
+	struct slab_cache*c;
+	struct slab_depot*d;
+	int node;
+
+	c = cl_tls_get (s->cache_key);
+	if (c) return c;
+
+	/* first time this thread is here */
+	c = cl_malloc (sizeof (struct slab_cache) );
+	if (!c) return 0;
+
+	node = cl_current_node();
+	d = s->depot + (node < s->ndepots ? node : 0);
+
+	c->d = d;
+	c->loaded = magazine_new();
+	c->prev = magazine_new();
+	if (! (c->loaded && c->prev) ) goto error;
+
+	if (cl_tls_set (s->cache_key, c) ) goto error;
+
+	cl_mutex_lock (d->m);
+	c->next = d->caches;
+	c->pprev = &d->caches;
+	if (c->next) c->next->pprev = &c->next;
+	d->caches = c;
+	cl_mutex_unlock (d->m);
+
+	return c;
+
+error:
+	if (c->loaded) cl_free (c->loaded);
+	if (c->prev) cl_free (c->prev);
+	cl_free (c);
+	return 0;
+}
+
+/*
+ * slab frontend
+ */
+
+struct cl_slab* cl_slab_create (size_t size) {
+
+	struct cl_slab*s;
+	struct slab_depot*d;
+	int i;
+
+	s = cl_malloc (sizeof (struct cl_slab) );
+	if (!s) return 0;
+
+	s->size = size;
+	s->ndepots = cl_node_count();
+	s->depot = cl_malloc (s->ndepots * sizeof (struct slab_depot) );
+	if (!s->depot) goto error_depot;
+
+	for (i = 0;i < s->ndepots;++i) {
+		d = s->depot + i;
+		d->full = d->empty = 0;
+		d->nfull = 0;
+		d->caches = 0;
+		if (cl_mutex_init (&d->m) ) goto error_mutex;
+	}
+
+	if (cl_tls_init (&s->cache_key, cache_release) ) goto error_mutex;
+
+	return s;
+
+error_mutex:
+	while (i > 0) cl_mutex_destroy (s->depot[--i].m);
+	cl_free (s->depot);
+error_depot:
+	cl_free (s);
+	return 0;
+}
+
+void cl_slab_destroy (struct cl_slab*s)
+{
+	/*
+	 * nobody may use the slab anymore, so we can just free the caches of
+	 * all threads.
+	 */
+
+	struct magazine*m;
+	struct slab_cache*c;
+	struct slab_depot*d;
+	int i;
+
+	cl_tls_destroy (s->cache_key);
+
+	for (i = 0;i < s->ndepots;++i) {
+		d = s->depot + i;
+
+		while (d->caches) {
+			c = d->caches;
+			d->caches = c->next;
+			magazine_free (c->loaded);
+			magazine_free (c->prev);
+			cl_free (c);
+		}
+
+		while (d->full) {
+			m = d->full;
+			d->full = m->next;
+			magazine_free (m);
+		}
+
+		while (d->empty) {
+			m = d->empty;
+			d->empty = m->next;
+			cl_free (m);
+		}
+
+		cl_mutex_destroy (d->m);
+	}
+
+	cl_free (s->depot);
+	cl_free (s);
+}
+
+void* cl_slab_alloc (struct cl_slab*s)
+{
+	struct slab_cache*c;
+	struct slab_depot*d;
+	struct magazine*m;
+
+	c = get_cache (s);
+	if (!c) return cl_malloc (s->size);
+	d = c->d;
+
+	if (!c->loaded->n) {
+
+		if (c->prev->n) {
+			m = c->loaded;
+			c->loaded = c->prev;
+			c->prev = m;
+
+		} else {
+			/* both empty, trade one for a full one from depot */
+			cl_mutex_lock (d->m);
+
+			if ( (m = d->full) ) {
+				d->full = m->next;
+				--d->nfull;
+
+				c->prev->next = d->empty;
+				d->empty = c->prev;
+
+				c->prev = c->loaded;
+				c->loaded = m;
+			}
+
+			cl_mutex_unlock (d->m);
+
+			if (!m) return cl_malloc (s->size);
+		}
+	}
+
+	return c->loaded->obj[--c->loaded->n];
+}
+
+void cl_slab_free (struct cl_slab*s, void*p)
+{
+	struct slab_cache*c;
+	struct slab_depot*d;
+	struct magazine*m;
+
+	c = get_cache (s);
+	if (!c) {
+		cl_free (p);
+		return;
+	}
+	d = c->d;
+
+	if (c->loaded->n == MAG_SIZE) {
+
+		if (c->prev->n < MAG_SIZE) {
+			m = c->loaded;
+			c->loaded = c->prev;
+			c->prev = m;
+
+		} else {
+			/* both full, give one to depot for an empty one */
+			cl_mutex_lock (d->m);
+
+			if ( (m = d->empty) ) {
+				d->empty = m->next;
+				depot_put (d, c->prev);
+			}
+
+			cl_mutex_unlock (d->m);
+
+			if (!m) {
+				/* depot has no empty magazines, make one */
+				m = magazine_new();
+
+				if (!m) {
+					cl_free (p);
+					return;
+				}
+
+				cl_mutex_lock (d->m);
+				depot_put (d, c->prev);
+				cl_mutex_unlock (d->m);
+			}
+
+			c->prev = c->loaded;
+			c->loaded = m;
+		}
+	}
+
+	c->loaded->obj[c->loaded->n++] = p;
+}
+
@@ -0,0 +1,117 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE /* for affinity stuff */
+
+#include "thread.h"
+
+/*
+ * this wraps pthreads, same as mutex.c
+ */
+
+#include "alloc.h"
+#include "topology.h"
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+int cl_thread_create (cl_thread* tp, void* (*func) (void*), void*arg,
+                      size_t stack_size)
+{
+	pthread_attr_t attr;
+	int r;
+
+	*tp = cl_malloc (sizeof (pthread_t) );
+	if (! (*tp) ) return 1;
+
+	if (pthread_attr_init (&attr) ) goto error;
+
+	r = stack_size ? pthread_attr_setstacksize (&attr, stack_size) : 0;
+	if (!r) r = pthread_create ( (pthread_t*) *tp, &attr, func, arg);
+
+	pthread_attr_destroy (&attr);
+
+	if (!r) return 0;
+error:
+	cl_free (*tp);
+	return 1;
+}
+
+int cl_thread_join (cl_thread t)
+{
+	int r = pthread_join (* (pthread_t*) t, 0);
+	cl_free (t);
+	return r;
+}
+
+void cl_thread_yield()
+{
+	sched_yield();
+}
+
+int cl_thread_set_affinity (int n)
+{
+	cpu_set_t allowed, set;
+	int cpu, count, node;
+
+	if (sched_getaffinity (0, sizeof (cpu_set_t), &allowed) ) return 1;
+
+	count = CPU_COUNT (&allowed);
+	if (!count) return 1;
+	n %= count;
+
+	/* count node by node, so that neighbor threads share the node */
+	for (node = 0;node < cl_node_count();++node) {
+		for (cpu = 0;cpu < CPU_SETSIZE;++cpu)
+			if (CPU_ISSET (cpu, &allowed) && cl_cpu_node (cpu) == node
+			        && ! (n--) ) break;
+		if (cpu < CPU_SETSIZE) break;
+	}
+
+	CPU_ZERO (&set);
+	CPU_SET (cpu, &set);
+
+	return pthread_setaffinity_np (pthread_self(), sizeof (cpu_set_t), &set);
+}
+
+int cl_cpu_count()
+{
+	long n = sysconf (_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+int cl_tls_init (cl_tls* kp, void (*destructor) (void*) )
+{
+	*kp = cl_malloc (sizeof (pthread_key_t) );
+	if (! (*kp) ) return 1;
+	if (!pthread_key_create ( (pthread_key_t*) *kp, destructor) ) return 0;
+	cl_free (*kp);
+	return 1;
+}
+
+int cl_tls_destroy (cl_tls k)
+{
+	int r = pthread_key_delete (* (pthread_key_t*) k);
+	cl_free (k);
+	return r;
+}
+
+void* cl_tls_get (cl_tls k)
+{
+	return pthread_getspecific (* (pthread_key_t*) k);
+}
+
+int cl_tls_set (cl_tls k, void*v)
+{
+	return pthread_setspecific (* (pthread_key_t*) k, v);
+}
+
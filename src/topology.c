@@ -0,0 +1,88 @@
+
+/*
+ * CloudVPN
+ *
+ * This program is a free software: You can redistribute and/or modify it
+ * under the terms of GNU GPLv3 license, or any later version of the license.
+ * The program is distributed in a good hope it will be useful, but without
+ * any warranty - see the aforementioned license for more details.
+ * You should have received a copy of the license along with this program;
+ * if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE /* for sched_getcpu */
+
+#include "topology.h"
+
+#include <stdio.h>
+#include <sched.h>
+
+/*
+ * Linux lists cpus of every node in /sys/devices/system/node/nodeN/cpulist,
+ * in the form like "0-7,16-23". Cpus that we don't find there stay on node 0.
+ */
+
+#define NODE_PATH "/sys/devices/system/node/node%d/cpulist"
+
+static int nnodes = 1;
+static unsigned char cpu_node[CL_MAX_CPUS];
+
+static int read_cpulist (FILE*f, int node)
+{
+	/* returns the number of cpus found */
+
+	int a, b, c, n = 0;
+
+	while (fscanf (f, "%d", &a) == 1) {
+		b = a;
+		c = fgetc (f);
+		if (c == '-') {
+			if (fscanf (f, "%d", &b) != 1) break;
+			c = fgetc (f);
+		}
+
+		for (;a <= b && a < CL_MAX_CPUS;++a, ++n)
+			if (a >= 0) cpu_node[a] = node;
+
+		if (c != ',') break;
+	}
+
+	return n;
+}
+
+void cl_topology_init()
+{
+	int node, last = 0;
+	char path[64];
+	FILE*f;
+
+	/* node numbers may have holes (for offline nodes), so try them all */
+	for (node = 0;node < CL_MAX_NODES;++node) {
+		snprintf (path, sizeof (path), NODE_PATH, node);
+
+		f = fopen (path, "r");
+		if (!f) continue;
+
+		if (read_cpulist (f, node) ) last = node;
+		fclose (f);
+	}
+
+	nnodes = last + 1;
+}
+
+int cl_node_count()
+{
+	return nnodes;
+}
+
+int cl_cpu_node (int cpu)
+{
+	if (cpu < 0 || cpu >= CL_MAX_CPUS) return 0;
+	return cpu_node[cpu];
+}
+
+int cl_current_node()
+{
+	return nnodes > 1 ? cl_cpu_node (sched_getcpu() ) : 0;
+}
+